@@ -26,6 +26,15 @@
 #define TAPPING_TERM 300
 #define RELEASING_TERM 80
 
+// sm_td can learn the tap terms of the home row mods and thumb keys, drifting from the hand tuned
+// SMTD_TIMEOUTS and writing its statistics to EEPROM every 10 minutes at most, off by default
+// #define SMTD_ADAPTIVE_TERMS
+// #define EECONFIG_USER_DATA_SIZE 162
+
+// sm_td can tap a home row mod right away when it is pressed within this many ms of the press of
+// a letter, a typing streak, off by default
+// #define HRM_STREAK_TERM 100
+
 #define ENCODER_RESOLUTION 2
 #define MOUSEKEY_TIME_TO_MAX 10
 
@@ -31,9 +31,6 @@ enum dilemma_keymap_layers { LAYER_BASE = 0, LAYER_FUNCTION, LAYER_NAVIGATION, L
 #    define SNIPING KC_NO
 #endif // !POINTING_DEVICE_ENABLE
 
-// sm_td setup
-#define MAX_DEFERRED_EXECUTORS 10
-
 // single key aliases
 #define LT_OUT LGUI(LCTL(KC_Q))
 #define MO_MOUSE MO(LAYER_VIRT_MOUSE)
@@ -65,45 +62,78 @@ enum custom_keycodes {
     RT_INR,
     RT_MID,
     RT_OUT,
-
-    // pointer
-    CKC_Z,
-    CKC_SLSH,
     SMTD_KEYCODES_END,
 
     CKC_ESC,
 
+    // prints the sm_td latency histograms, trace and timeouts to the console, see SMTD_LATENCY_STATS,
+    // SMTD_TRACE and SMTD_TIMEOUTS_DUMP
+    SM_STAT,
+
     // multi encoder magic
     MULTI_ENC_CCW,
     MULTI_ENC_CW,
     MULT_ENC_CLK,
 };
-#include "sm_td.h"
 
-void on_smtd_action(uint16_t keycode, smtd_action action, uint8_t tap_count) {
-    switch (keycode) {
-        // left hand hrm
-        SMTD_MT(CKC_A, KC_A, KC_LEFT_ALT)
-        SMTD_MT(CKC_R, KC_R, KC_LEFT_GUI)
-        SMTD_MT(CKC_S, KC_S, KC_LEFT_CTRL)
-        SMTD_MT(CKC_T, KC_T, KC_LSFT)
-        // right hand hrm
-        SMTD_MT(CKC_N, KC_N, KC_LSFT)
-        SMTD_MT(CKC_E, KC_E, KC_LEFT_CTRL)
-        SMTD_MT(CKC_I, KC_I, KC_LEFT_GUI)
-        SMTD_MT(CKC_O, KC_O, KC_LEFT_ALT)
-        // left thumb cluster
-        SMTD_LT(LT_MID, KC_SPACE, LAYER_NAVIGATION)
-        SMTD_LT(LT_INR, KC_ESCAPE, LAYER_FUNCTION)
-        // right thumb cluster
-        SMTD_LT(RT_INR, KC_TAB, LAYER_MEDIA)
-        SMTD_LT(RT_MID, KC_BSPC, LAYER_NUMERAL)
-        SMTD_LT(RT_OUT, KC_ENTER, LAYER_SYMBOLS)
-        // pointer keys
-        SMTD_LT(CKC_Z, KC_Z, LAYER_POINTER)
-        SMTD_LT(CKC_SLSH, KC_SLSH, LAYER_POINTER)
-    }
-}
+// sm_td timeouts in ms, SMTD_DEFAULT_TIMEOUT keeps the global term. The typing streak of the home row
+// mods is off unless config.h sets HRM_STREAK_TERM
+#ifndef HRM_STREAK_TERM
+#    define HRM_STREAK_TERM 0
+#endif
+
+//    keycode  tap                                sequence               following_tap          release                streak
+#define SMTD_TIMEOUTS(X)                                                                                                                     \
+    /* thumbs, longer since they are weaker keys */                                                                                          \
+    X(LT_MID,  SMTD_GLOBAL_TAP_TERM * 170 / 100,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT) \
+    X(LT_INR,  SMTD_GLOBAL_TAP_TERM * 170 / 100,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT) \
+    X(RT_INR,  SMTD_GLOBAL_TAP_TERM * 170 / 100,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT) \
+    X(RT_MID,  SMTD_GLOBAL_TAP_TERM * 170 / 100,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT) \
+    X(RT_OUT,  SMTD_GLOBAL_TAP_TERM * 170 / 100,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT) \
+    /* pinkies and ring fingers */                                                                                                           \
+    X(CKC_A,   SMTD_GLOBAL_TAP_TERM * 2,          SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  8,                     HRM_STREAK_TERM)      \
+    X(CKC_R,   SMTD_GLOBAL_TAP_TERM * 2,          SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  8,                     HRM_STREAK_TERM)      \
+    X(CKC_I,   SMTD_GLOBAL_TAP_TERM * 2,          SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  8,                     HRM_STREAK_TERM)      \
+    X(CKC_O,   SMTD_GLOBAL_TAP_TERM * 2,          SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  8,                     HRM_STREAK_TERM)      \
+    /* middle fingers */                                                                                                                     \
+    X(CKC_S,   SMTD_GLOBAL_TAP_TERM * 150 / 100,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  8,                     HRM_STREAK_TERM)      \
+    X(CKC_E,   SMTD_GLOBAL_TAP_TERM * 150 / 100,  SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  8,                     HRM_STREAK_TERM)      \
+    /* index fingers, shorter for the stronger shift keys */                                                                                 \
+    X(CKC_T,   SMTD_GLOBAL_TAP_TERM * 50 / 100,   SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  8,                     HRM_STREAK_TERM)      \
+    X(CKC_N,   SMTD_GLOBAL_TAP_TERM * 50 / 100,   SMTD_DEFAULT_TIMEOUT,  SMTD_DEFAULT_TIMEOUT,  8,                     HRM_STREAK_TERM)
+
+// sm_td macro keys
+//    keycode   kind          tap_key    mod_or_layer      threshold  caps_word
+#define SMTD_ACTIONS(X)                                                     \
+    /* left hand hrm */                                                     \
+    X(CKC_A,    SMTD_KIND_MT, KC_A,      KC_LEFT_ALT,      1000,      true) \
+    X(CKC_R,    SMTD_KIND_MT, KC_R,      KC_LEFT_GUI,      1000,      true) \
+    X(CKC_S,    SMTD_KIND_MT, KC_S,      KC_LEFT_CTRL,     1000,      true) \
+    X(CKC_T,    SMTD_KIND_MT, KC_T,      KC_LSFT,          1000,      true) \
+    /* right hand hrm */                                                    \
+    X(CKC_N,    SMTD_KIND_MT, KC_N,      KC_LSFT,          1000,      true) \
+    X(CKC_E,    SMTD_KIND_MT, KC_E,      KC_LEFT_CTRL,     1000,      true) \
+    X(CKC_I,    SMTD_KIND_MT, KC_I,      KC_LEFT_GUI,      1000,      true) \
+    X(CKC_O,    SMTD_KIND_MT, KC_O,      KC_LEFT_ALT,      1000,      true) \
+    /* left thumb cluster */                                                \
+    X(LT_MID,   SMTD_KIND_LT, KC_SPACE,  LAYER_NAVIGATION, 1000,      true) \
+    X(LT_INR,   SMTD_KIND_LT, KC_ESCAPE, LAYER_FUNCTION,   1000,      true) \
+    /* right thumb cluster */                                               \
+    X(RT_INR,   SMTD_KIND_LT, KC_TAB,    LAYER_MEDIA,      1000,      true) \
+    X(RT_MID,   SMTD_KIND_LT, KC_BSPC,   LAYER_NUMERAL,    1000,      true) \
+    X(RT_OUT,   SMTD_KIND_LT, KC_ENTER,  LAYER_SYMBOLS,    1000,      true)
+
+// sm_td keys taken by their position in smtd_position_map, they tap the keycode of the layout
+//    name       kind          mod_or_layer   threshold  caps_word
+#define SMTD_POSITIONS(X)                                          \
+    /* pointer keys */                                             \
+    X(PTR_Z,     SMTD_KIND_LT, LAYER_POINTER, 1000,      true)     \
+    X(PTR_SLSH,  SMTD_KIND_LT, LAYER_POINTER, 1000,      true)     \
+    X(GAME_SLSH, SMTD_KIND_LT, LAYER_POINTER, 1000,      true)
+
+// same-hand rolls tapped on the second press, regenerate with sm_td_bigrams.py from typing logs
+#include "sm_td_bigrams.h"
+#include "sm_td.h"
 
 // actions
 #define _UNDO LGUI(KC_Z)
@@ -121,7 +151,7 @@ const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS] = {
   // ├─────────────────────────────────────────────┤ ├─────────────────────────────────────────────┤
          CKC_A,   CKC_R,    CKC_S,   CKC_T,  KC_G,       KC_M,   CKC_N,   CKC_E,   CKC_I,   CKC_O,
   // ├─────────────────────────────────────────────┤ ├─────────────────────────────────────────────┤
-         CKC_Z,    KC_X,    KC_C,    KC_D,   KC_V,       KC_K,    KC_H, KC_COMM,  KC_DOT, CKC_SLSH,
+         KC_Z,    KC_X,    KC_C,    KC_D,   KC_V,       KC_K,    KC_H, KC_COMM,  KC_DOT, KC_SLSH,
   // ╰─────────────────────────────────────────────┤ ├─────────────────────────────────────────────╯
                            LT_OUT, LT_MID, LT_INR,       RT_INR, RT_MID, RT_OUT
   //                   ╰───────────────────────────╯ ╰──────────────────────────╯
@@ -143,11 +173,12 @@ const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS] = {
  * Secondary right-hand layer has function keys mirroring the numerals on the
  * primary layer with extras on the pinkie column, plus system keys on the inner
  * column. App is on the tertiary thumb key and other thumb keys are duplicated
- * from the base layer to enable auto-repeat.
+ * from the base layer to enable auto-repeat. The top left key dumps the sm_td
+ * latency stats, trace and timeouts.
  */
   [LAYER_FUNCTION] = LAYOUT_split_3x5_3(
   // ╭─────────────────────────────────────────────╮ ╭─────────────────────────────────────────────╮
-       XXXXXXX, XXXXXXX, XXXXXXX, XXXXXXX, XXXXXXX,     KC_PSCR,  KC_F7,  KC_F8,   KC_F9,  KC_F12,
+       SM_STAT, XXXXXXX, XXXXXXX, XXXXXXX, XXXXXXX,     KC_PSCR,  KC_F7,  KC_F8,   KC_F9,  KC_F12,
   // ├─────────────────────────────────────────────┤ ├─────────────────────────────────────────────┤
        KC_LALT, KC_LGUI, KC_LCTL, KC_LSFT, KC_ESC,      KC_PAUS,  KC_F4,  KC_F5,   KC_F6,  KC_F11,
   // ├─────────────────────────────────────────────┤ ├─────────────────────────────────────────────┤
@@ -262,7 +293,7 @@ const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS] = {
   // ├─────────────────────────────────────────────┤ ├─────────────────────────────────────────────┤
        KC_LSFT,   KC_A,     KC_S,    KC_D,   KC_G,       KC_H,    KC_J,    KC_K,   KC_L,  KC_SCLN,
   // ├─────────────────────────────────────────────┤ ├─────────────────────────────────────────────┤
-       KC_LCTL,   KC_X,     KC_C,    KC_V,   KC_B,      KC_N,    KC_M, KC_COMM,  KC_DOT, CKC_SLSH,
+       KC_LCTL,   KC_X,     KC_C,    KC_V,   KC_B,      KC_N,    KC_M, KC_COMM,  KC_DOT, KC_SLSH,
   // ╰─────────────────────────────────────────────┤ ├─────────────────────────────────────────────╯
                     TO(LAYER_BASE), KC_SPC, CKC_ESC,     RT_INR, KC_SPC, RT_OUT
   //                   ╰───────────────────────────╯ ╰──────────────────────────╯
@@ -297,13 +328,40 @@ const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS] = {
   /* // ├─────────────────────────────────────────────┤ ├─────────────────────────────────────────────┤ */
   /*        KC_A,    KC_S,     KC_D,    KC_F,   KC_G,       KC_H,    KC_J,    KC_K,   KC_L,  KC_SCLN, */
   /* // ├─────────────────────────────────────────────┤ ├─────────────────────────────────────────────┤ */
-  /*        KC_Z,    KC_X,     KC_C,    KC_V,   KC_B,       KC_N,    KC_M, KC_COMM,  KC_DOT, CKC_SLSH, */
+  /*        KC_Z,    KC_X,     KC_C,    KC_V,   KC_B,       KC_N,    KC_M, KC_COMM,  KC_DOT, KC_SLSH, */
   /* // ╰─────────────────────────────────────────────┤ ├─────────────────────────────────────────────╯ */
   /*                     TO(LAYER_BASE), KC_SPC, KC_ESC,   RT_INR, KC_SPC, RT_OUT */
   /* //                   ╰───────────────────────────╯ ╰──────────────────────────╯ */
   /* ), */
 };
 
+/** \brief Keys handled by sm_td through SMTD_POSITIONS, on top of the sm_td keycodes. */
+const uint8_t PROGMEM smtd_position_map[][MATRIX_ROWS][MATRIX_COLS] = {
+  [LAYER_BASE] = LAYOUT_split_3x5_3(
+  // ╭─────────────────────────────────────────────╮ ╭─────────────────────────────────────────────╮
+            0,       0,        0,       0,      0,          0,       0,       0,      0,       0,
+  // ├─────────────────────────────────────────────┤ ├─────────────────────────────────────────────┤
+            0,       0,        0,       0,      0,          0,       0,       0,      0,       0,
+  // ├─────────────────────────────────────────────┤ ├─────────────────────────────────────────────┤
+  SMTD_POSITION(PTR_Z), 0,     0,       0,      0,          0,       0,       0,      0, SMTD_POSITION(PTR_SLSH),
+  // ╰─────────────────────────────────────────────┤ ├─────────────────────────────────────────────╯
+                                0,      0,      0,          0,       0,       0
+  //                   ╰───────────────────────────╯ ╰──────────────────────────╯
+  ),
+  [LAYER_GAMING] = LAYOUT_split_3x5_3(
+  // ╭─────────────────────────────────────────────╮ ╭─────────────────────────────────────────────╮
+            0,       0,        0,       0,      0,          0,       0,       0,      0,       0,
+  // ├─────────────────────────────────────────────┤ ├─────────────────────────────────────────────┤
+            0,       0,        0,       0,      0,          0,       0,       0,      0,       0,
+  // ├─────────────────────────────────────────────┤ ├─────────────────────────────────────────────┤
+            0,       0,        0,       0,      0,          0,       0,       0,      0, SMTD_POSITION(GAME_SLSH),
+  // ╰─────────────────────────────────────────────┤ ├─────────────────────────────────────────────╯
+                                0,      0,      0,          0,       0,       0
+  //                   ╰───────────────────────────╯ ╰──────────────────────────╯
+  ),
+};
+const uint8_t smtd_position_layers = ARRAY_SIZE(smtd_position_map);
+
 // clang-format on
 
 // -- advanced configuration starts here
@@ -427,6 +485,24 @@ bool process_my_custom_keycodes(uint16_t keycode, keyrecord_t *record) {
                 unregister_code(KC_TAB);
             }
             return false;
+
+        case SM_STAT:
+#ifdef SMTD_LATENCY_STATS
+            if (record->event.pressed) {
+                smtd_latency_dump();
+            }
+#endif
+#ifdef SMTD_TRACE
+            if (record->event.pressed) {
+                smtd_trace_dump();
+            }
+#endif
+#ifdef SMTD_TIMEOUTS_DUMP
+            if (record->event.pressed) {
+                smtd_timeouts_dump();
+            }
+#endif
+            return false;
     }
     return true;
 }
@@ -447,42 +523,8 @@ bool process_record_user(uint16_t keycode, keyrecord_t *record) {
     return true;
 }
 
-uint32_t get_smtd_timeout(uint16_t keycode, smtd_timeout timeout) {
-    uint32_t fallback = get_smtd_timeout_default(timeout);
-    switch (keycode) {
-        // thumbs
-        case RT_INR:
-        case RT_MID:
-        case RT_OUT:
-        case LT_MID:
-        case LT_INR:
-            if (timeout == SMTD_TIMEOUT_TAP) return fallback + (fallback * 70 / 100); // make it longer for the thumb keys and weaker keys
-
-        case CKC_A:
-        case CKC_O:
-        case CKC_R:
-        case CKC_I:
-            if (timeout == SMTD_TIMEOUT_TAP) return fallback * 2;
-
-        case CKC_S:
-        case CKC_E:
-            if (timeout == SMTD_TIMEOUT_TAP) return fallback + (fallback * 50 / 100);
-
-        case CKC_T:
-        case CKC_N:
-            if (timeout == SMTD_TIMEOUT_TAP) return fallback - (fallback * 50 / 100); // make it shorter for the stronger shift keys
-    }
-
-    /* if (timeout == SMTD_TIMEOUT_RELEASE && keycode >= CKC_A && keycode <= CKC_O) return 10; */
-
-    if (timeout == SMTD_TIMEOUT_RELEASE) {
-        switch (keycode) {
-            case CKC_A ... CKC_O:
-                return 8;
-        }
-    }
-
-    return fallback;
+void housekeeping_task_user(void) {
+    smtd_task();
 }
 
 bool caps_word_press_user(uint16_t keycode) {
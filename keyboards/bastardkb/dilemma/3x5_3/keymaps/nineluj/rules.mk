@@ -2,6 +2,4 @@ VIA_ENABLE = no
 ENCODER_MAP_ENABLE = yes
 CAPS_WORD_ENABLE = yes
 KEY_OVERRIDE_ENABLE = yes
-# needed for sm_td
-DEFERRED_EXEC_ENABLE = yes
 COMBO_ENABLE = yes
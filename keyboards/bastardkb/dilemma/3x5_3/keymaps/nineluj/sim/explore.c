@@ -0,0 +1,311 @@
+/* Copyright 2024 nineluj <code@nineluj.com> (@nineluj)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Exhaustive state-space explorer for sm_td.h on the Dilemma keymap.
+ *
+ * Enumerates every interleaving of presses and releases of up to N keys out
+ * of a key set, with every gap of a gap set after each event. The search
+ * forks at each step, so a prefix is simulated once and its children start
+ * from a copy of its state. Whenever no key is held, the scenario runs until
+ * no stage timeout is left and the invariants are checked:
+ *
+ *   - no mod or key is left in the report
+ *   - no layer is left on and the sm_td layer stack is empty
+ *   - no state, timer or swallowed release is left behind
+ *   - the state pool, the replay queue and the layer stack never overflowed
+ *
+ * It also records the worst cost of a single input event, and of a single
+ * scan while keys are held: process_record() calls, reports sent, layer
+ * changes, process_record() nesting and host stack use. Each comes with
+ * the script that reached it.
+ *
+ *   sm_td_explore [-n KEYS] [-k "s t x LM RM"] [-g "1 10 120 700"]
+ */
+
+#define SIM_NO_MAIN
+#include "sim.c"
+
+#include <sys/mman.h>
+
+#define EXPLORE_MAX_KEYS 8
+#define EXPLORE_MAX_GAPS 8
+#define EXPLORE_MAX_FAILURES 10
+#define EXPLORE_SCRIPT_SIZE 256
+
+typedef enum {
+    EXPLORE_RECORDS,
+    EXPLORE_REPORTS,
+    EXPLORE_LAYER_CHANGES,
+    EXPLORE_NESTING,
+    EXPLORE_STACK,
+    EXPLORE_METRICS,
+} explore_metric;
+
+static const char *explore_metric_names[EXPLORE_METRICS] = {"process_record calls", "reports", "layer changes", "nesting", "stack bytes"};
+
+typedef struct {
+    uint32_t value;
+    char     script[EXPLORE_SCRIPT_SIZE];
+} explore_worst;
+
+/** Shared by every process of the search, children run one at a time so no locking is needed */
+typedef struct {
+    uint64_t      scenarios;
+    uint64_t      failures;
+    explore_worst per_event[EXPLORE_METRICS];
+    explore_worst per_scan[EXPLORE_METRICS];
+    char          failure_scripts[EXPLORE_MAX_FAILURES][EXPLORE_SCRIPT_SIZE + 64];
+} explore_results;
+
+static explore_results *results;
+
+static keypos_t    explore_keys[EXPLORE_MAX_KEYS];
+static const char *explore_key_names[EXPLORE_MAX_KEYS];
+static uint8_t     explore_key_count = 0;
+static uint32_t    explore_gaps[EXPLORE_MAX_GAPS];
+static uint8_t     explore_gap_count = 0;
+static uint8_t     explore_max_keys  = 3;
+
+/** The steps taken so far, in the sm_td_sim script format */
+static char explore_script[EXPLORE_SCRIPT_SIZE];
+
+/** Starts counting the cost of the next events from here */
+static __attribute__((noinline)) void sim_cost_reset(void) {
+    sim_cost            = (sim_cost_t){0};
+    sim_cost.stack_base = sim_stack_pointer();
+    sim_cost.stack_low  = sim_cost.stack_base;
+}
+
+/** Feeds an event stamped now, then scans once */
+static void sim_event(keypos_t key, bool pressed) {
+    sim_event_aged(key, pressed, 0);
+}
+
+static void explore_append(const char *format, const char *name, uint32_t number) {
+    size_t len = strlen(explore_script);
+    snprintf(explore_script + len, sizeof(explore_script) - len, format, name, number);
+}
+
+static void explore_record_cost(explore_worst *worst) {
+    uint32_t values[EXPLORE_METRICS] = {
+        [EXPLORE_RECORDS]       = sim_cost.records,
+        [EXPLORE_REPORTS]       = sim_cost.reports,
+        [EXPLORE_LAYER_CHANGES] = sim_cost.layer_changes,
+        [EXPLORE_NESTING]       = sim_cost.max_nesting,
+        [EXPLORE_STACK]         = sim_cost_stack(),
+    };
+    for (uint8_t metric = 0; metric < EXPLORE_METRICS; metric++) {
+        if (values[metric] > worst[metric].value) {
+            worst[metric].value = values[metric];
+            strcpy(worst[metric].script, explore_script);
+        }
+    }
+}
+
+static void explore_fail(const char *reason) {
+    if (results->failures < EXPLORE_MAX_FAILURES) {
+        snprintf(results->failure_scripts[results->failures], sizeof(results->failure_scripts[0]), "%s: %s", reason, explore_script);
+    }
+    results->failures++;
+}
+
+static bool explore_report_empty(void) {
+    for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+        if (keyboard_report.keys[i]) {
+            return false;
+        }
+    }
+    return !keyboard_report.mods;
+}
+
+static bool explore_streak_clear(void) {
+    for (size_t i = 0; i < sizeof(smtd_streak_keys); i++) {
+        if (smtd_streak_keys[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Runs in a child: lets the held-free scenario settle, then checks the invariants */
+static void explore_check(void) {
+    results->scenarios++;
+
+    // nothing can change once the last stage timeout has fired, a few more scans flush the outputs
+    while (smtd_timer_slots) {
+        sim_advance(1);
+    }
+    sim_advance(20);
+
+    if (real_mods || weak_mods || oneshot_mods || !explore_report_empty()) {
+        explore_fail("stuck mods or keys");
+    }
+    if (layer_state || smtd_layer_depth != 0) {
+        explore_fail("leaked layer");
+    }
+    if (smtd_live_slots || smtd_timer_slots || !explore_streak_clear()) {
+        explore_fail("state left behind");
+    }
+    if (smtd_pool_overflows || smtd_replay_overflows || smtd_layer_overflows) {
+        explore_fail("pool, replay queue or layer stack overflow");
+    }
+}
+
+/** Waits for a forked child, a crash counts as a failure of the script that caused it */
+static void explore_wait(pid_t pid) {
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        explore_fail("crashed");
+    }
+}
+
+static void explore(uint8_t used, uint8_t held) {
+    if (!held && used) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            explore_check();
+            _exit(0);
+        }
+        explore_wait(pid);
+    }
+
+    for (uint8_t key = 0; key < explore_key_count; key++) {
+        bool pressed = used & (1 << key);
+        bool is_held = held & (1 << key);
+        if ((pressed && !is_held) || (!pressed && __builtin_popcount(used) >= explore_max_keys)) {
+            continue;
+        }
+
+        uint8_t next_used = used | (1 << key);
+        uint8_t next_held = held ^ (1 << key);
+
+        // the scenario settles after the last release anyway, so its gap is not enumerated
+        bool    last      = !next_held && __builtin_popcount(next_used) == explore_max_keys;
+        uint8_t gap_count = last ? 1 : explore_gap_count;
+
+        for (uint8_t gap = 0; gap < gap_count; gap++) {
+            pid_t pid = fork();
+            if (pid != 0) {
+                explore_wait(pid);
+                continue;
+            }
+
+            explore_append(explore_script[0] ? " %s%c" : "%s%c", explore_key_names[key], is_held ? '-' : '+');
+            sim_cost_reset();
+            sim_event(explore_keys[key], !is_held);
+            explore_record_cost(results->per_event);
+
+            if (!last) {
+                explore_append(" %s%u", "", explore_gaps[gap]);
+                for (uint32_t ms = 0; ms < explore_gaps[gap]; ms++) {
+                    // without a pending stage timeout the scans in between do nothing, so they are skipped
+                    if (!smtd_timer_slots) {
+                        sim_now += explore_gaps[gap] - ms - 1;
+                        ms = explore_gaps[gap] - 1;
+                    }
+                    sim_cost_reset();
+                    sim_advance(1);
+                    if (next_held) {
+                        explore_record_cost(results->per_scan);
+                    }
+                }
+            }
+
+            explore(next_used, next_held);
+            _exit(0);
+        }
+    }
+}
+
+static void explore_usage(void) {
+    fprintf(stderr, "usage: sm_td_explore [-n KEYS] [-k \"KEY...\"] [-g \"MS...\"]\n");
+    exit(2);
+}
+
+static void explore_parse_keys(char *list) {
+    explore_key_count = 0;
+    for (char *name = strtok(list, " "); name; name = strtok(NULL, " ")) {
+        if (explore_key_count == EXPLORE_MAX_KEYS || !sim_find_key(name, strlen(name), &explore_keys[explore_key_count])) {
+            fprintf(stderr, "bad or too many keys: %s\n", name);
+            exit(2);
+        }
+        explore_key_names[explore_key_count++] = name;
+    }
+}
+
+static void explore_parse_gaps(char *list) {
+    explore_gap_count = 0;
+    for (char *gap = strtok(list, " "); gap; gap = strtok(NULL, " ")) {
+        if (explore_gap_count == EXPLORE_MAX_GAPS) {
+            fprintf(stderr, "too many gaps\n");
+            exit(2);
+        }
+        explore_gaps[explore_gap_count++] = strtoul(gap, NULL, 10);
+    }
+}
+
+int main(int argc, char **argv) {
+    static char keys[256] = "s t x LM RM", gaps[256] = "1 10 120 700";
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 == argc) {
+            explore_usage();
+        } else if (strcmp(argv[i], "-n") == 0) {
+            explore_max_keys = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0) {
+            snprintf(keys, sizeof(keys), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "-g") == 0) {
+            snprintf(gaps, sizeof(gaps), "%s", argv[++i]);
+        } else {
+            explore_usage();
+        }
+    }
+
+    printf("exploring up to %u keys of \"%s\" with gaps of \"%s\" ms\n", explore_max_keys, keys, gaps);
+    explore_parse_keys(keys);
+    explore_parse_gaps(gaps);
+    if (!explore_max_keys || explore_max_keys > explore_key_count || !explore_gap_count) {
+        explore_usage();
+    }
+
+    results = mmap(NULL, sizeof(explore_results), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        return 2;
+    }
+    memset(results, 0, sizeof(explore_results));
+
+    // housekeeping runs long before the first key press on a real board
+    sim_scan();
+    explore(0, 0);
+
+    printf("%llu scenarios, %llu invariant violations\n", (unsigned long long)results->scenarios, (unsigned long long)results->failures);
+    for (uint64_t i = 0; i < results->failures && i < EXPLORE_MAX_FAILURES; i++) {
+        printf("  %s\n", results->failure_scripts[i]);
+    }
+
+    printf("worst case per input event:\n");
+    for (uint8_t metric = 0; metric < EXPLORE_METRICS; metric++) {
+        printf("  %-22s %5u  %s\n", explore_metric_names[metric], results->per_event[metric].value, results->per_event[metric].script);
+    }
+    printf("worst case per scan while keys are held:\n");
+    for (uint8_t metric = 0; metric < EXPLORE_METRICS; metric++) {
+        printf("  %-22s %5u  %s\n", explore_metric_names[metric], results->per_scan[metric].value, results->per_scan[metric].script);
+    }
+
+    return results->failures ? 1 : 0;
+}
@@ -0,0 +1,520 @@
+/* Copyright 2024 nineluj <code@nineluj.com> (@nineluj)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Minimal host-side stand-in for the parts of QMK that keymap.c and sm_td.h
+ * touch. Only the behavior the simulator needs is modelled: a virtual clock,
+ * the keyboard report, mods, layers, deferred executors and the keycode
+ * ranges used by the keymap, plus whatever the keymap's combos, key overrides
+ * and RGB code need to compile. Everything lives in this header so the whole
+ * simulator is a single translation unit.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* ************************************* *
+ *            PLATFORM SHIMS             *
+ * ************************************* */
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+#define pgm_read_ptr(p) (*(void *const *)(p))
+#define memcpy_P(d, s, n) memcpy(d, s, n)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define MATRIX_ROWS 8
+#define MATRIX_COLS 5
+typedef uint8_t matrix_row_t;
+#define MATRIX_ROW_SHIFTER ((matrix_row_t)1)
+#define NUM_ENCODERS 1
+#define NUM_DIRECTIONS 2
+
+#define dprintf(...)
+#define dprintln(s)
+#define uprintf printf
+
+/* ************************************* *
+ *                TIMER                  *
+ * ************************************* */
+
+extern uint32_t sim_now;
+
+static inline uint16_t timer_read(void) {
+    return (uint16_t)sim_now;
+}
+static inline uint32_t timer_read32(void) {
+    return sim_now;
+}
+static inline uint16_t timer_elapsed(uint16_t last) {
+    return (uint16_t)(timer_read() - last);
+}
+static inline uint32_t timer_elapsed32(uint32_t last) {
+    return sim_now - last;
+}
+#define timer_expired(current, future) ((uint16_t)((current) - (future)) < UINT16_C(0x8000))
+#define timer_expired32(current, future) ((uint32_t)((current) - (future)) < UINT32_C(0x80000000))
+
+void wait_ms(uint32_t ms);
+
+/* ************************************* *
+ *              KEYCODES                 *
+ * ************************************* */
+
+enum sim_keycodes {
+    KC_NO = 0x00,
+    KC_TRANSPARENT,
+    KC_A = 0x04,
+    KC_B,
+    KC_C,
+    KC_D,
+    KC_E,
+    KC_F,
+    KC_G,
+    KC_H,
+    KC_I,
+    KC_J,
+    KC_K,
+    KC_L,
+    KC_M,
+    KC_N,
+    KC_O,
+    KC_P,
+    KC_Q,
+    KC_R,
+    KC_S,
+    KC_T,
+    KC_U,
+    KC_V,
+    KC_W,
+    KC_X,
+    KC_Y,
+    KC_Z,
+    KC_1,
+    KC_2,
+    KC_3,
+    KC_4,
+    KC_5,
+    KC_6,
+    KC_7,
+    KC_8,
+    KC_9,
+    KC_0,
+    KC_ENTER,
+    KC_ESCAPE,
+    KC_BACKSPACE,
+    KC_TAB,
+    KC_SPACE,
+    KC_MINUS,
+    KC_EQUAL,
+    KC_LEFT_BRACKET,
+    KC_RIGHT_BRACKET,
+    KC_BACKSLASH,
+    KC_NONUS_HASH,
+    KC_SEMICOLON,
+    KC_QUOTE,
+    KC_GRAVE,
+    KC_COMMA,
+    KC_DOT,
+    KC_SLASH,
+    KC_CAPS_LOCK,
+    KC_F1,
+    KC_F2,
+    KC_F3,
+    KC_F4,
+    KC_F5,
+    KC_F6,
+    KC_F7,
+    KC_F8,
+    KC_F9,
+    KC_F10,
+    KC_F11,
+    KC_F12,
+    KC_PRINT_SCREEN,
+    KC_SCROLL_LOCK,
+    KC_PAUSE,
+    KC_INSERT,
+    KC_HOME,
+    KC_PAGE_UP,
+    KC_DELETE,
+    KC_END,
+    KC_PAGE_DOWN,
+    KC_RIGHT,
+    KC_LEFT,
+    KC_DOWN,
+    KC_UP,
+    KC_F13 = 0x68,
+    KC_F14,
+    KC_F15,
+    KC_F16,
+    KC_F17,
+    KC_F18,
+    KC_F19,
+    KC_AUDIO_MUTE = 0xA8,
+    KC_AUDIO_VOL_UP,
+    KC_AUDIO_VOL_DOWN,
+    KC_MEDIA_NEXT_TRACK,
+    KC_MEDIA_PREV_TRACK,
+    KC_MEDIA_STOP,
+    KC_MEDIA_PLAY_PAUSE,
+    KC_MS_UP = 0xCD,
+    KC_MS_DOWN,
+    KC_MS_LEFT,
+    KC_MS_RIGHT,
+    KC_MS_BTN1,
+    KC_MS_BTN2,
+    KC_MS_BTN3,
+    KC_MS_WH_UP = 0xD9,
+    KC_MS_WH_DOWN,
+    KC_MS_WH_LEFT,
+    KC_MS_WH_RIGHT,
+    KC_LEFT_CTRL = 0xE0,
+    KC_LEFT_SHIFT,
+    KC_LEFT_ALT,
+    KC_LEFT_GUI,
+    KC_RIGHT_CTRL,
+    KC_RIGHT_SHIFT,
+    KC_RIGHT_ALT,
+    KC_RIGHT_GUI,
+};
+
+#define XXXXXXX KC_NO
+#define _______ KC_TRANSPARENT
+#define KC_TRNS KC_TRANSPARENT
+#define KC_ENT KC_ENTER
+#define KC_ESC KC_ESCAPE
+#define KC_BSPC KC_BACKSPACE
+#define KC_SPC KC_SPACE
+#define KC_MINS KC_MINUS
+#define KC_EQL KC_EQUAL
+#define KC_LBRC KC_LEFT_BRACKET
+#define KC_RBRC KC_RIGHT_BRACKET
+#define KC_BSLS KC_BACKSLASH
+#define KC_SCLN KC_SEMICOLON
+#define KC_QUOT KC_QUOTE
+#define KC_COMM KC_COMMA
+#define KC_SLSH KC_SLASH
+#define KC_PSCR KC_PRINT_SCREEN
+#define KC_SCRL KC_SCROLL_LOCK
+#define KC_PAUS KC_PAUSE
+#define KC_INS KC_INSERT
+#define KC_PGUP KC_PAGE_UP
+#define KC_DEL KC_DELETE
+#define KC_PGDN KC_PAGE_DOWN
+#define KC_RGHT KC_RIGHT
+#define KC_MUTE KC_AUDIO_MUTE
+#define KC_VOLU KC_AUDIO_VOL_UP
+#define KC_VOLD KC_AUDIO_VOL_DOWN
+#define KC_MNXT KC_MEDIA_NEXT_TRACK
+#define KC_MPRV KC_MEDIA_PREV_TRACK
+#define KC_MSTP KC_MEDIA_STOP
+#define KC_MPLY KC_MEDIA_PLAY_PAUSE
+#define KC_LCTL KC_LEFT_CTRL
+#define KC_LSFT KC_LEFT_SHIFT
+#define KC_LALT KC_LEFT_ALT
+#define KC_LGUI KC_LEFT_GUI
+#define KC_BTN1 KC_MS_BTN1
+#define KC_BTN2 KC_MS_BTN2
+#define KC_BTN3 KC_MS_BTN3
+#define KC_WH_U KC_MS_WH_UP
+#define KC_WH_D KC_MS_WH_DOWN
+#define KC_WH_L KC_MS_WH_LEFT
+#define KC_WH_R KC_MS_WH_RIGHT
+#define MS_UP KC_MS_UP
+#define MS_DOWN KC_MS_DOWN
+#define MS_LEFT KC_MS_LEFT
+#define MS_RGHT KC_MS_RIGHT
+#define MS_BTN1 KC_MS_BTN1
+#define MS_BTN2 KC_MS_BTN2
+#define MS_BTN3 KC_MS_BTN3
+#define MS_WHLU KC_MS_WH_UP
+#define MS_WHLD KC_MS_WH_DOWN
+
+#define QK_MODS 0x0100
+#define QK_MODS_MAX 0x1FFF
+#define QK_TO 0x5200
+#define QK_MOMENTARY 0x5220
+#define QK_BOOTLOADER 0x7C00
+#define QK_CLEAR_EEPROM 0x7C03
+#define QK_CAPS_WORD_TOGGLE 0x7C73
+#define RGB_TOG 0x7820
+#define RGB_MOD 0x7821
+#define RGB_RMOD 0x7822
+#define SAFE_RANGE 0x7E40
+#define QK_USER_MAX 0x7FFF
+
+#define QK_BOOT QK_BOOTLOADER
+#define EE_CLR QK_CLEAR_EEPROM
+#define CW_TOGG QK_CAPS_WORD_TOGGLE
+
+#define QK_LCTL 0x0100
+#define QK_LSFT 0x0200
+#define QK_LALT 0x0400
+#define QK_LGUI 0x0800
+#define LCTL(kc) (QK_LCTL | (kc))
+#define LSFT(kc) (QK_LSFT | (kc))
+#define LALT(kc) (QK_LALT | (kc))
+#define LGUI(kc) (QK_LGUI | (kc))
+#define S(kc) LSFT(kc)
+#define C(kc) LCTL(kc)
+#define TO(layer) (QK_TO | ((layer)&0x1F))
+#define MO(layer) (QK_MOMENTARY | ((layer)&0x1F))
+
+#define KC_TILD LSFT(KC_GRAVE)
+#define KC_EXLM LSFT(KC_1)
+#define KC_AT LSFT(KC_2)
+#define KC_HASH LSFT(KC_3)
+#define KC_DLR LSFT(KC_4)
+#define KC_PERC LSFT(KC_5)
+#define KC_CIRC LSFT(KC_6)
+#define KC_AMPR LSFT(KC_7)
+#define KC_ASTR LSFT(KC_8)
+#define KC_LPRN LSFT(KC_9)
+#define KC_RPRN LSFT(KC_0)
+#define KC_UNDS LSFT(KC_MINUS)
+#define KC_PLUS LSFT(KC_EQUAL)
+#define KC_LCBR LSFT(KC_LEFT_BRACKET)
+#define KC_RCBR LSFT(KC_RIGHT_BRACKET)
+#define KC_PIPE LSFT(KC_BACKSLASH)
+#define KC_COLN LSFT(KC_SEMICOLON)
+
+#define IS_MODIFIER_KEYCODE(code) ((code) >= KC_LEFT_CTRL && (code) <= KC_RIGHT_GUI)
+#define MOD_BIT(code) (1 << ((code)&0x07))
+#define MOD_MASK_CTRL (MOD_BIT(KC_LEFT_CTRL) | MOD_BIT(KC_RIGHT_CTRL))
+#define MOD_MASK_SHIFT (MOD_BIT(KC_LEFT_SHIFT) | MOD_BIT(KC_RIGHT_SHIFT))
+#define MOD_MASK_ALT (MOD_BIT(KC_LEFT_ALT) | MOD_BIT(KC_RIGHT_ALT))
+#define MOD_MASK_GUI (MOD_BIT(KC_LEFT_GUI) | MOD_BIT(KC_RIGHT_GUI))
+
+/* ************************************* *
+ *            KEY EVENTS                 *
+ * ************************************* */
+
+typedef struct {
+    uint8_t col;
+    uint8_t row;
+} keypos_t;
+
+typedef enum { TICK_EVENT = 0, KEY_EVENT = 1 } keyevent_type_t;
+
+typedef struct {
+    keypos_t        key;
+    uint16_t        time;
+    keyevent_type_t type;
+    bool            pressed;
+} keyevent_t;
+
+typedef struct {
+    bool    interrupted : 1;
+    bool    reserved2 : 1;
+    bool    reserved1 : 1;
+    bool    reserved0 : 1;
+    uint8_t count : 4;
+} tap_t;
+
+typedef struct {
+    keyevent_t event;
+    tap_t      tap;
+    uint16_t   keycode;
+} keyrecord_t;
+
+#define MAKE_KEYPOS(row_num, col_num) ((keypos_t){.row = (row_num), .col = (col_num)})
+#define MAKE_KEYEVENT(row_num, col_num, press) ((keyevent_t){.key = MAKE_KEYPOS((row_num), (col_num)), .pressed = (press), .time = timer_read(), .type = KEY_EVENT})
+
+void process_record(keyrecord_t *record);
+bool process_record_user(uint16_t keycode, keyrecord_t *record);
+
+/* ************************************* *
+ *          REPORT AND MODS              *
+ * ************************************* */
+
+#define KEYBOARD_REPORT_KEYS 6
+
+typedef struct {
+    uint8_t mods;
+    uint8_t reserved;
+    uint8_t keys[KEYBOARD_REPORT_KEYS];
+} report_keyboard_t;
+
+typedef struct {
+    uint8_t (*keyboard_leds)(void);
+    void (*send_keyboard)(report_keyboard_t *);
+} host_driver_t;
+
+host_driver_t *host_get_driver(void);
+void           host_set_driver(host_driver_t *driver);
+
+uint8_t get_mods(void);
+void    set_mods(uint8_t mods);
+void    add_mods(uint8_t mods);
+void    del_mods(uint8_t mods);
+void    clear_mods(void);
+uint8_t get_weak_mods(void);
+void    set_weak_mods(uint8_t mods);
+void    add_weak_mods(uint8_t mods);
+void    del_weak_mods(uint8_t mods);
+void    clear_weak_mods(void);
+uint8_t get_oneshot_mods(void);
+void    set_oneshot_mods(uint8_t mods);
+void    clear_oneshot_mods(void);
+void    register_mods(uint8_t mods);
+void    unregister_mods(uint8_t mods);
+void    send_keyboard_report(void);
+
+void register_code(uint8_t code);
+void unregister_code(uint8_t code);
+void register_code16(uint16_t code);
+void unregister_code16(uint16_t code);
+void tap_code16(uint16_t code);
+
+bool is_caps_word_on(void);
+
+/* ************************************* *
+ *               LAYERS                  *
+ * ************************************* */
+
+typedef uint32_t layer_state_t;
+
+extern layer_state_t layer_state;
+extern layer_state_t default_layer_state;
+
+uint8_t get_highest_layer(layer_state_t state);
+bool    layer_state_cmp(layer_state_t state, uint8_t layer);
+bool    layer_state_is(uint8_t layer);
+void    layer_state_set(layer_state_t state);
+void    layer_clear(void);
+void    layer_move(uint8_t layer);
+void    layer_on(uint8_t layer);
+void    layer_off(uint8_t layer);
+uint8_t read_source_layers_cache(keypos_t key);
+uint8_t layer_switch_get_layer(keypos_t key);
+
+extern const uint16_t keymaps[][MATRIX_ROWS][MATRIX_COLS];
+uint16_t              keymap_key_to_keycode(uint8_t layer, keypos_t key);
+
+/* ************************************* *
+ *           DEFERRED EXECUTION          *
+ * ************************************* */
+
+typedef uint8_t deferred_token;
+typedef uint32_t (*deferred_exec_callback)(uint32_t trigger_time, void *cb_arg);
+#define INVALID_DEFERRED_TOKEN 0
+
+deferred_token defer_exec(uint32_t delay_ms, deferred_exec_callback callback, void *cb_arg);
+bool           extend_deferred_exec(deferred_token token, uint32_t delay_ms);
+bool           cancel_deferred_exec(deferred_token token);
+
+/* ************************************* *
+ *              EEPROM                   *
+ * ************************************* */
+
+#ifndef EECONFIG_USER_DATA_SIZE
+#    define EECONFIG_USER_DATA_SIZE 0
+#endif
+
+void eeconfig_read_user_datablock(void *data, uint32_t offset, uint32_t length);
+void eeconfig_update_user_datablock(const void *data, uint32_t offset, uint32_t length);
+
+/* ************************************* *
+ *        FEATURE STAND-INS              *
+ * ************************************* */
+
+#define LAYOUT_split_3x5_3(                               \
+    L00, L01, L02, L03, L04, R00, R01, R02, R03, R04,     \
+    L10, L11, L12, L13, L14, R10, R11, R12, R13, R14,     \
+    L20, L21, L22, L23, L24, R20, R21, R22, R23, R24,     \
+    L32, L33, L34, R30, R31, R32)                         \
+    {                                                     \
+        {L00, L01, L02, L03, L04},                        \
+        {L10, L11, L12, L13, L14},                        \
+        {L20, L21, L22, L23, L24},                        \
+        {KC_NO, KC_NO, L32, L33, L34},                    \
+        {R00, R01, R02, R03, R04},                        \
+        {R10, R11, R12, R13, R14},                        \
+        {R20, R21, R22, R23, R24},                        \
+        {R30, R31, R32, KC_NO, KC_NO},                    \
+    }
+
+typedef struct {
+    uint8_t  trigger_mods;
+    uint16_t trigger;
+    uint16_t replacement;
+} key_override_t;
+
+#define ko_make_basic(mods, trigger_key, replacement_key) ((const key_override_t){.trigger_mods = (mods), .trigger = (trigger_key), .replacement = (replacement_key)})
+
+typedef struct {
+    const uint16_t *keys;
+    uint16_t        keycode;
+} combo_t;
+
+#define COMBO_END 0
+#define COMBO(ck, ca) {.keys = &(ck)[0], .keycode = (ca)}
+
+/* the RGB matrix is never drawn, the stand-ins only have to compile */
+
+typedef struct {
+    uint8_t h, s, v;
+} HSV;
+
+typedef struct {
+    uint8_t r, g, b;
+} RGB;
+
+#define HSV_CHARTREUSE 64, 255, 255
+#define HSV_WHITE 0, 0, 255
+#define HSV_PURPLE 191, 255, 255
+#define HSV_TEAL 128, 255, 128
+#define HSV_AZURE 132, 102, 255
+#define HSV_MAGENTA 213, 255, 255
+#define HSV_ORANGE 21, 255, 255
+#define HSV_CYAN 128, 255, 255
+#define HSV_GOLD 36, 255, 255
+#define HSV_PINK 234, 128, 255
+#define HSV_GREEN 85, 255, 255
+#define HSV_RED 0, 255, 255
+
+typedef struct {
+    uint8_t flags[36];
+} led_config_t;
+
+static led_config_t g_led_config;
+
+#define HAS_FLAGS(bits, flags) (((bits) & (flags)) == (flags))
+#define LED_FLAG_UNDERGLOW 0x02
+
+static inline HSV rgb_matrix_get_hsv(void) {
+    return (HSV){0, 0, 0};
+}
+static inline uint8_t rgb_matrix_get_val(void) {
+    return 0;
+}
+static inline RGB hsv_to_rgb(HSV hsv) {
+    return (RGB){hsv.h, hsv.s, hsv.v};
+}
+static inline void rgb_matrix_set_color(uint8_t index, uint8_t red, uint8_t green, uint8_t blue) {
+    (void)index;
+    (void)red;
+    (void)green;
+    (void)blue;
+}
@@ -0,0 +1,43 @@
+#!/usr/bin/env python3
+"""Prints random sm_td_sim scripts that press and release keys of the Dilemma base layer.
+
+Usage: scripts.py [SEED] [COUNT]
+"""
+
+import random
+import sys
+
+# home row mods, pointer and thumb keys, and a few plain letters
+KEYS = "a r s t n e i o z / LM LI RI RM RO x c h m g".split()
+
+# gaps around the interesting terms: streak, release, tap terms and their multiples
+WAITS = [0, 1, 5, 9, 20, 60, 140, 160, 290, 310, 440, 460, 500, 520, 590, 610, 900]
+
+
+def script(rng):
+    held, steps = [], []
+    for _ in range(rng.randint(2, 14)):
+        if held and (rng.random() < 0.5 or len(held) > 3):
+            key = rng.choice(held)
+            held.remove(key)
+            steps.append(key + "-")
+        else:
+            key = rng.choice([key for key in KEYS if key not in held])
+            held.append(key)
+            steps.append(key + "+")
+        steps.append(str(rng.choice(WAITS)))
+    rng.shuffle(held)
+    for key in held:
+        steps.append(key + "-")
+        steps.append(str(rng.choice(WAITS)))
+    return " ".join(steps)
+
+
+def main():
+    rng = random.Random(int(sys.argv[1]) if len(sys.argv) > 1 else 1)
+    for _ in range(int(sys.argv[2]) if len(sys.argv) > 2 else 5000):
+        print(script(rng))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,702 @@
+/* Copyright 2024 nineluj <code@nineluj.com> (@nineluj)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Deterministic host simulator for the Dilemma keymap and sm_td.h.
+ *
+ * A scenario is a line of space separated steps: "s+" presses the key
+ * labelled s on the base layer, "s-" releases it and a number advances the
+ * virtual clock by that many milliseconds, scanning once per millisecond.
+ * "~300" advances it without scanning, like a stalled main loop, and "s+@40"
+ * is a press stamped 40 ms before it arrives, like one from the split half.
+ * Every scenario ends with two idle seconds and prints the HID reports and
+ * layer changes it produced:
+ *
+ *   s+ 20 t+ 30 s- 20 t- => [00 16][00][00 17][00] | mods=00 layer=0
+ *
+ * "[mods keys...]" is a keyboard report and "{Lstate}" a layer change, the
+ * tail is the state left behind. Every scenario runs in a forked copy of a
+ * fresh process, so the static state of sm_td never leaks between them.
+ *
+ *   sm_td_sim [--time] < scripts        prints the result of every script
+ *   sm_td_sim [--time] FILE...          checks "script => expected" lines
+ *
+ * --time prefixes every report with the milliseconds since the start.
+ * explore.c reuses everything but main() with SIM_NO_MAIN defined.
+ */
+
+#include "qmk_stub.h"
+
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+uint32_t sim_now = 1000;
+
+static bool sim_log_time = false;
+
+/* ************************************* *
+ *                COST                   *
+ * ************************************* */
+
+/** What the engine did since the last sim_cost_reset(), read by the explorer */
+typedef struct {
+    /** process_record() calls, replays included */
+    uint32_t records;
+
+    /** Reports sent to the host */
+    uint32_t reports;
+
+    /** Layer state changes */
+    uint32_t layer_changes;
+
+    /** How deeply process_record() calls were nested at most */
+    uint8_t max_nesting;
+    uint8_t nesting;
+
+    /** Stack used below the caller of sim_cost_reset(), sampled at every hook, in bytes */
+    uintptr_t stack_base;
+    uintptr_t stack_low;
+} sim_cost_t;
+
+static sim_cost_t sim_cost;
+
+static __attribute__((noinline)) uintptr_t sim_stack_pointer(void) {
+    return (uintptr_t)__builtin_frame_address(0);
+}
+
+static inline void sim_cost_sample_stack(void) {
+    uintptr_t sp = sim_stack_pointer();
+    if (sp < sim_cost.stack_low) {
+        sim_cost.stack_low = sp;
+    }
+}
+
+static inline uint32_t sim_cost_stack(void) {
+    return sim_cost.stack_base - sim_cost.stack_low;
+}
+
+/* ************************************* *
+ *                 LOG                   *
+ * ************************************* */
+
+static char   sim_log[64 * 1024];
+static size_t sim_log_len = 0;
+
+static void sim_log_str(const char *str) {
+    size_t len = strlen(str);
+    if (sim_log_len + len + 1 < sizeof(sim_log)) {
+        memcpy(sim_log + sim_log_len, str, len + 1);
+        sim_log_len += len;
+    }
+}
+
+/* ************************************* *
+ *           REPORT AND MODS             *
+ * ************************************* */
+
+static report_keyboard_t keyboard_report;
+static report_keyboard_t last_report;
+static uint8_t           real_mods, weak_mods, oneshot_mods;
+
+static void sim_send_keyboard(report_keyboard_t *report) {
+    sim_cost.reports++;
+    sim_cost_sample_stack();
+
+    char buffer[64];
+    int  len = 0;
+    if (sim_log_time) {
+        len = snprintf(buffer, sizeof(buffer), "%u", (unsigned)(sim_now - 1000));
+    }
+    len += snprintf(buffer + len, sizeof(buffer) - len, "[%02x", report->mods);
+    for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+        if (report->keys[i]) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, " %02x", report->keys[i]);
+        }
+    }
+    snprintf(buffer + len, sizeof(buffer) - len, "]");
+    sim_log_str(buffer);
+}
+
+static host_driver_t  sim_driver  = {.send_keyboard = sim_send_keyboard};
+static host_driver_t *host_driver = &sim_driver;
+
+host_driver_t *host_get_driver(void) {
+    return host_driver;
+}
+
+void host_set_driver(host_driver_t *driver) {
+    host_driver = driver;
+}
+
+void send_keyboard_report(void) {
+    keyboard_report.mods = real_mods | weak_mods | oneshot_mods;
+    if (memcmp(&keyboard_report, &last_report, sizeof(keyboard_report)) != 0) {
+        last_report = keyboard_report;
+        host_driver->send_keyboard(&keyboard_report);
+    }
+}
+
+uint8_t get_mods(void) {
+    return real_mods;
+}
+void set_mods(uint8_t mods) {
+    real_mods = mods;
+}
+void add_mods(uint8_t mods) {
+    real_mods |= mods;
+}
+void del_mods(uint8_t mods) {
+    real_mods &= ~mods;
+}
+void clear_mods(void) {
+    real_mods = 0;
+}
+uint8_t get_weak_mods(void) {
+    return weak_mods;
+}
+void set_weak_mods(uint8_t mods) {
+    weak_mods = mods;
+}
+void add_weak_mods(uint8_t mods) {
+    weak_mods |= mods;
+}
+void del_weak_mods(uint8_t mods) {
+    weak_mods &= ~mods;
+}
+void clear_weak_mods(void) {
+    weak_mods = 0;
+}
+uint8_t get_oneshot_mods(void) {
+    return oneshot_mods;
+}
+void set_oneshot_mods(uint8_t mods) {
+    oneshot_mods = mods;
+}
+void clear_oneshot_mods(void) {
+    oneshot_mods = 0;
+}
+
+void register_mods(uint8_t mods) {
+    if (mods) {
+        add_mods(mods);
+        send_keyboard_report();
+    }
+}
+
+void unregister_mods(uint8_t mods) {
+    if (mods) {
+        del_mods(mods);
+        send_keyboard_report();
+    }
+}
+
+static void sim_add_key(uint8_t code) {
+    for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+        if (keyboard_report.keys[i] == code) {
+            return;
+        }
+    }
+    for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+        if (!keyboard_report.keys[i]) {
+            keyboard_report.keys[i] = code;
+            return;
+        }
+    }
+}
+
+static void sim_del_key(uint8_t code) {
+    for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+        if (keyboard_report.keys[i] == code) {
+            keyboard_report.keys[i] = 0;
+        }
+    }
+}
+
+void register_code(uint8_t code) {
+    if (code == KC_NO) {
+        return;
+    }
+    if (IS_MODIFIER_KEYCODE(code)) {
+        add_mods(MOD_BIT(code));
+    } else {
+        sim_add_key(code);
+    }
+    send_keyboard_report();
+}
+
+void unregister_code(uint8_t code) {
+    if (code == KC_NO) {
+        return;
+    }
+    if (IS_MODIFIER_KEYCODE(code)) {
+        del_mods(MOD_BIT(code));
+    } else {
+        sim_del_key(code);
+    }
+    send_keyboard_report();
+}
+
+/** The left hand mods of a 16 bit keycode, the keymap never uses the right hand ones */
+static uint8_t sim_mods_of(uint16_t code) {
+    return (code >> 8) & 0x0F;
+}
+
+void register_code16(uint16_t code) {
+    uint8_t mods = sim_mods_of(code);
+    if (IS_MODIFIER_KEYCODE(code & 0xFF) || (code & 0xFF) == KC_NO) {
+        register_mods(mods);
+    } else if (mods) {
+        add_weak_mods(mods);
+    }
+    register_code(code & 0xFF);
+}
+
+void unregister_code16(uint16_t code) {
+    uint8_t mods = sim_mods_of(code);
+    unregister_code(code & 0xFF);
+    if (IS_MODIFIER_KEYCODE(code & 0xFF) || (code & 0xFF) == KC_NO) {
+        unregister_mods(mods);
+    } else if (mods) {
+        del_weak_mods(mods);
+        send_keyboard_report();
+    }
+}
+
+void tap_code16(uint16_t code) {
+    register_code16(code);
+    unregister_code16(code);
+}
+
+bool is_caps_word_on(void) {
+    return false;
+}
+
+/* ************************************* *
+ *               LAYERS                  *
+ * ************************************* */
+
+layer_state_t layer_state         = 0;
+layer_state_t default_layer_state = 1;
+
+uint8_t get_highest_layer(layer_state_t state) {
+    for (int layer = 31; layer >= 0; layer--) {
+        if (state & ((layer_state_t)1 << layer)) {
+            return layer;
+        }
+    }
+    return 0;
+}
+
+bool layer_state_cmp(layer_state_t state, uint8_t layer) {
+    return (state & ((layer_state_t)1 << layer)) != 0;
+}
+bool layer_state_is(uint8_t layer) {
+    return layer_state_cmp(layer_state, layer);
+}
+
+void layer_state_set(layer_state_t state) {
+    sim_cost.layer_changes++;
+    sim_cost_sample_stack();
+
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "{L%x}", (unsigned)state);
+    sim_log_str(buffer);
+    layer_state = state;
+}
+
+void layer_clear(void) {
+    layer_state_set(0);
+}
+void layer_move(uint8_t layer) {
+    layer_state_set((layer_state_t)1 << layer);
+}
+void layer_on(uint8_t layer) {
+    layer_state_set(layer_state | ((layer_state_t)1 << layer));
+}
+void layer_off(uint8_t layer) {
+    layer_state_set(layer_state & ~((layer_state_t)1 << layer));
+}
+
+static uint8_t source_layers[MATRIX_ROWS][MATRIX_COLS];
+
+uint8_t read_source_layers_cache(keypos_t key) {
+    return source_layers[key.row][key.col];
+}
+
+/** The highest active layer where the key is not transparent */
+uint8_t layer_switch_get_layer(keypos_t key) {
+    layer_state_t state = layer_state | default_layer_state;
+    for (int layer = 31; layer >= 0; layer--) {
+        if ((state & ((layer_state_t)1 << layer)) && keymaps[layer][key.row][key.col] != KC_TRNS) {
+            return layer;
+        }
+    }
+    return 0;
+}
+
+uint16_t keymap_key_to_keycode(uint8_t layer, keypos_t key) {
+    return keymaps[layer][key.row][key.col];
+}
+
+/* ************************************* *
+ *           DEFERRED EXECUTION          *
+ * ************************************* */
+
+#define SIM_MAX_EXECUTORS 8
+
+typedef struct {
+    deferred_token         token;
+    uint32_t               trigger;
+    deferred_exec_callback callback;
+    void                  *arg;
+} sim_executor_t;
+
+static sim_executor_t sim_executors[SIM_MAX_EXECUTORS];
+static deferred_token sim_last_token = INVALID_DEFERRED_TOKEN;
+
+deferred_token defer_exec(uint32_t delay_ms, deferred_exec_callback callback, void *cb_arg) {
+    for (int i = 0; i < SIM_MAX_EXECUTORS; i++) {
+        if (sim_executors[i].token == INVALID_DEFERRED_TOKEN) {
+            if (++sim_last_token == INVALID_DEFERRED_TOKEN) {
+                ++sim_last_token;
+            }
+            sim_executors[i] = (sim_executor_t){sim_last_token, sim_now + delay_ms, callback, cb_arg};
+            return sim_last_token;
+        }
+    }
+    return INVALID_DEFERRED_TOKEN;
+}
+
+bool extend_deferred_exec(deferred_token token, uint32_t delay_ms) {
+    for (int i = 0; i < SIM_MAX_EXECUTORS; i++) {
+        if (token != INVALID_DEFERRED_TOKEN && sim_executors[i].token == token) {
+            sim_executors[i].trigger = sim_now + delay_ms;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool cancel_deferred_exec(deferred_token token) {
+    for (int i = 0; i < SIM_MAX_EXECUTORS; i++) {
+        if (token != INVALID_DEFERRED_TOKEN && sim_executors[i].token == token) {
+            sim_executors[i].token = INVALID_DEFERRED_TOKEN;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void sim_deferred_exec_task(void) {
+    for (int i = 0; i < SIM_MAX_EXECUTORS; i++) {
+        sim_executor_t *executor = &sim_executors[i];
+        if (executor->token != INVALID_DEFERRED_TOKEN && timer_expired32(sim_now, executor->trigger)) {
+            deferred_token token = executor->token;
+            uint32_t       delay = executor->callback(executor->trigger, executor->arg);
+            if (executor->token != token) {
+                continue;
+            }
+            if (delay == 0) {
+                executor->token = INVALID_DEFERRED_TOKEN;
+            } else {
+                executor->trigger = sim_now + delay;
+            }
+        }
+    }
+}
+
+/* ************************************* *
+ *               EEPROM                  *
+ * ************************************* */
+
+static uint8_t sim_eeprom[1024];
+
+_Static_assert(EECONFIG_USER_DATA_SIZE <= sizeof(sim_eeprom), "sim: EECONFIG_USER_DATA_SIZE does not fit the simulated EEPROM");
+
+void eeconfig_read_user_datablock(void *data, uint32_t offset, uint32_t length) {
+    memcpy(data, sim_eeprom + offset, length);
+}
+
+void eeconfig_update_user_datablock(const void *data, uint32_t offset, uint32_t length) {
+    memcpy(sim_eeprom + offset, data, length);
+}
+
+/* ************************************* *
+ *          KEYMAP UNDER TEST            *
+ * ************************************* */
+
+#include "keymap.c"
+
+__attribute__((weak)) void matrix_scan_user(void);
+void                       housekeeping_task_user(void);
+
+void wait_ms(uint32_t ms) {
+    sim_now += ms;
+}
+
+static void sim_scan(void) {
+    sim_deferred_exec_task();
+    if (matrix_scan_user) {
+        matrix_scan_user();
+    }
+    housekeeping_task_user();
+}
+
+/** Resolves the keycode like QMK's action layer, then runs the basic keycodes the keymap passes on */
+static void sim_process_record(keyrecord_t *record) {
+    keypos_t key = record->event.key;
+    uint8_t  layer;
+    if (record->event.pressed) {
+        layer                           = layer_switch_get_layer(key);
+        source_layers[key.row][key.col] = layer;
+    } else {
+        layer = source_layers[key.row][key.col];
+    }
+
+    uint16_t keycode = keymap_key_to_keycode(layer, key);
+    if (!process_record_user(keycode, record)) {
+        return;
+    }
+
+    if (keycode <= 0xFF) {
+        if (record->event.pressed) {
+            register_code(keycode);
+        } else {
+            unregister_code(keycode);
+        }
+    } else if (QK_MODS <= keycode && keycode <= QK_MODS_MAX) {
+        if (record->event.pressed) {
+            register_code16(keycode);
+        } else {
+            unregister_code16(keycode);
+        }
+    } else if ((keycode & 0xFFE0) == QK_MOMENTARY) {
+        if (record->event.pressed) {
+            layer_on(keycode & 0x1F);
+        } else {
+            layer_off(keycode & 0x1F);
+        }
+    } else if ((keycode & 0xFFE0) == QK_TO) {
+        if (record->event.pressed) {
+            layer_move(keycode & 0x1F);
+        }
+    }
+}
+
+void process_record(keyrecord_t *record) {
+    sim_cost.records++;
+    if (++sim_cost.nesting > sim_cost.max_nesting) {
+        sim_cost.max_nesting = sim_cost.nesting;
+    }
+    sim_cost_sample_stack();
+
+    sim_process_record(record);
+    sim_cost.nesting--;
+}
+
+/* ************************************* *
+ *              SCENARIOS                *
+ * ************************************* */
+
+/** The labels of the keys in the scripts, as they sit in the matrix */
+// clang-format off
+static const char *sim_key_names[MATRIX_ROWS][MATRIX_COLS] = {
+    {"q", "w", "f",  "p",  "b"},  {"a",  "r",  "s",  "t", "g"}, {"z", "x", "c", "d", "v"}, {"", "", "LO", "LM", "LI"},
+    {"j", "l", "u",  "y",  "'"},  {"m",  "n",  "e",  "i", "o"}, {"k", "h", ",", ".", "/"}, {"RI", "RM", "RO", "", ""},
+};
+// clang-format on
+
+static bool sim_find_key(const char *name, size_t len, keypos_t *key) {
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+        for (uint8_t col = 0; col < MATRIX_COLS; col++) {
+            if (len && strlen(sim_key_names[row][col]) == len && strncmp(sim_key_names[row][col], name, len) == 0) {
+                *key = MAKE_KEYPOS(row, col);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void sim_advance(uint32_t ms) {
+    for (uint32_t i = 0; i < ms; i++) {
+        sim_now++;
+        sim_scan();
+    }
+}
+
+/** Feeds an event stamped age ms ago, then scans once */
+static void sim_event_aged(keypos_t key, bool pressed, uint32_t age) {
+    keyrecord_t record = {.event = MAKE_KEYEVENT(key.row, key.col, pressed)};
+    record.event.time -= age;
+    process_record(&record);
+    sim_scan();
+}
+
+// Scripts and scenario files, the explorer feeds its events directly
+#ifndef SIM_NO_MAIN
+static bool sim_run_script(const char *script) {
+    // housekeeping runs long before the first key press on a real board
+    sim_scan();
+
+    while (*script) {
+        while (*script == ' ') {
+            script++;
+        }
+        if (!*script) {
+            break;
+        }
+        if ('0' <= *script && *script <= '9') {
+            sim_advance(strtoul(script, (char **)&script, 10));
+            continue;
+        }
+        if (*script == '~') {
+            sim_now += strtoul(script + 1, (char **)&script, 10);
+            continue;
+        }
+
+        const char *name = script;
+        while (*script && *script != '+' && *script != '-' && *script != ' ') {
+            script++;
+        }
+        keypos_t key;
+        if ((*script != '+' && *script != '-') || !sim_find_key(name, script - name, &key)) {
+            fprintf(stderr, "bad step in script: %s\n", name);
+            return false;
+        }
+        bool     pressed = *script++ == '+';
+        uint32_t age     = *script == '@' ? strtoul(script + 1, (char **)&script, 10) : 0;
+        sim_event_aged(key, pressed, age);
+    }
+
+    sim_advance(2000);
+    return true;
+}
+
+/** Runs a script in a child process and writes its result, without a trailing newline, to result */
+static bool sim_run(const char *script, char *result, size_t size) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        if (!sim_run_script(script)) {
+            _exit(2);
+        }
+        char tail[64];
+        snprintf(tail, sizeof(tail), " | mods=%02x layer=%x", real_mods | weak_mods, (unsigned)layer_state);
+        sim_log_str(tail);
+        if (write(pipe_fds[1], sim_log, sim_log_len) != (ssize_t)sim_log_len) {
+            _exit(3);
+        }
+        _exit(0);
+    }
+
+    close(pipe_fds[1]);
+    size_t  len = 0;
+    ssize_t got;
+    while (len + 1 < size && (got = read(pipe_fds[0], result + len, size - len - 1)) > 0) {
+        len += got;
+    }
+    result[len] = 0;
+    close(pipe_fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static char *sim_trim(char *str) {
+    while (*str == ' ') {
+        str++;
+    }
+    size_t len = strlen(str);
+    while (len && (str[len - 1] == ' ' || str[len - 1] == '\n' || str[len - 1] == '\r')) {
+        str[--len] = 0;
+    }
+    return str;
+}
+
+/** Checks every "script => expected" line of a scenario file, returns the number of failures */
+static int sim_check_file(const char *path, int *count) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+
+    static char line[8192], result[sizeof(sim_log)];
+    int         failures = 0;
+    for (int number = 1; fgets(line, sizeof(line), file); number++) {
+        char *script = sim_trim(line);
+        if (!*script || *script == '#') {
+            continue;
+        }
+
+        char *expected = strstr(script, "=>");
+        if (!expected) {
+            fprintf(stderr, "%s:%d: missing =>\n", path, number);
+            failures++;
+            continue;
+        }
+        *expected = 0;
+        expected  = sim_trim(expected + 2);
+        script    = sim_trim(script);
+
+        (*count)++;
+        if (!sim_run(script, result, sizeof(result)) || strcmp(result, expected) != 0) {
+            printf("%s:%d: FAIL %s\n  expected %s\n  got      %s\n", path, number, script, expected, result);
+            failures++;
+        }
+    }
+
+    fclose(file);
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    int first_file = 1;
+    if (argc > 1 && strcmp(argv[1], "--time") == 0) {
+        sim_log_time = true;
+        first_file++;
+    }
+
+    if (first_file < argc) {
+        int count = 0, failures = 0;
+        for (int i = first_file; i < argc; i++) {
+            failures += sim_check_file(argv[i], &count);
+        }
+        printf("%d scenarios, %d failed\n", count, failures);
+        return failures ? 1 : 0;
+    }
+
+    static char line[8192], result[sizeof(sim_log)];
+    while (fgets(line, sizeof(line), stdin)) {
+        char *script = sim_trim(line);
+        if (!*script || *script == '#') {
+            continue;
+        }
+        sim_run(script, result, sizeof(result));
+        printf("%s => %s\n", script, result);
+        fflush(stdout);
+    }
+    return 0;
+}
+#endif
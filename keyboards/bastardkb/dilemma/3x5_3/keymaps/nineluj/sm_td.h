@@ -20,16 +20,13 @@
 #pragma once
 
 #include QMK_KEYBOARD_H
-#include "deferred_exec.h"
+#include "host.h"
+#include "timer.h"
 
-#ifdef SMTD_DEBUG_ENABLED
+#if defined(SMTD_DEBUG_ENABLED) || defined(SMTD_LATENCY_STATS) || defined(SMTD_TRACE) || defined(SMTD_TIMEOUTS_DUMP)
 #    include "print.h"
 #endif
 
-#ifdef SMTD_GLOBAL_SIMULTANEOUS_PRESSES_DELAY_MS
-#    include "timer.h"
-#endif
-
 /* ************************************* *
  *         GLOBAL CONFIGURATION          *
  * ************************************* */
@@ -39,7 +36,8 @@
 #endif
 
 #if SMTD_GLOBAL_SIMULTANEOUS_PRESSES_DELAY_MS > 0
-#    define SMTD_SIMULTANEOUS_PRESSES_DELAY wait_ms(SMTD_GLOBAL_SIMULTANEOUS_PRESSES_DELAY_MS);
+// the next report is held back by the output scheduler instead of stalling the firmware
+#    define SMTD_SIMULTANEOUS_PRESSES_DELAY smtd_output_space();
 #else
 #    define SMTD_SIMULTANEOUS_PRESSES_DELAY
 #endif
@@ -60,6 +58,10 @@
 #    define SMTD_GLOBAL_RELEASE_TERM TAPPING_TERM / 4
 #endif
 
+#ifndef SMTD_GLOBAL_STREAK_TERM
+#    define SMTD_GLOBAL_STREAK_TERM 0
+#endif
+
 #ifndef SMTD_GLOBAL_MODS_RECALL
 #    define SMTD_GLOBAL_MODS_RECALL true
 #endif
@@ -68,11 +70,48 @@
 #    define SMTD_GLOBAL_AGGREGATE_TAPS false
 #endif
 
+/* ************************************* *
+ *              MACRO KEYS               *
+ * ************************************* */
+
+// The macro keys are the keycodes between SMTD_KEYCODES_BEGIN and SMTD_KEYCODES_END, plus one keycode
+// per SMTD_POSITIONS entry taken from the top of the user range, see POSITION KEYS. Per-key tables are
+// indexed by SMTD_KEY_INDEX(), custom keycodes first and position keys after them.
+
+#ifdef SMTD_POSITIONS
+#    define SMTD_POSITION_NAME(name, kind, mod_or_layer, threshold, use_cl) SMTD_POSITION_##name,
+
+enum { SMTD_POSITIONS(SMTD_POSITION_NAME) SMTD_POSITION_COUNT };
+
+#    define SMTD_POSITION_KEYCODES_BEGIN (QK_USER_MAX + 1 - SMTD_POSITION_COUNT)
+/** The keycode sm_td handles the position key of an SMTD_POSITIONS entry as */
+#    define SMTD_POSITION_KEYCODE(name) (SMTD_POSITION_KEYCODES_BEGIN + SMTD_POSITION_##name)
+
+_Static_assert(SMTD_KEYCODES_END <= SMTD_POSITION_KEYCODES_BEGIN, "sm_td: position keycodes overlap the custom keycodes");
+
+static uint16_t smtd_position_tap_key(uint16_t keycode);
+#else
+#    define SMTD_POSITION_COUNT 0
+#    define SMTD_POSITION_KEYCODES_BEGIN (QK_USER_MAX + 1)
+#endif
+
+#define SMTD_KEY_COUNT (SMTD_KEYCODES_END - SMTD_KEYCODES_BEGIN - 1 + SMTD_POSITION_COUNT)
+#define SMTD_KEY_INDEX(keycode) ((uint16_t)(keycode) < SMTD_POSITION_KEYCODES_BEGIN ? (keycode) - SMTD_KEYCODES_BEGIN - 1 : (keycode) - SMTD_POSITION_KEYCODES_BEGIN + SMTD_KEYCODES_END - SMTD_KEYCODES_BEGIN - 1)
+
+static inline bool smtd_is_macro_key(uint16_t keycode) {
+    return (SMTD_KEYCODES_BEGIN < keycode && keycode < SMTD_KEYCODES_END) || (SMTD_POSITION_KEYCODES_BEGIN <= keycode && keycode <= QK_USER_MAX);
+}
+
+/** The keycode of a SMTD_KEY_INDEX() */
+static inline uint16_t smtd_key_keycode(uint8_t index) {
+    return index < SMTD_KEYCODES_END - SMTD_KEYCODES_BEGIN - 1 ? SMTD_KEYCODES_BEGIN + 1 + index : SMTD_POSITION_KEYCODES_BEGIN + index - (SMTD_KEYCODES_END - SMTD_KEYCODES_BEGIN - 1);
+}
+
 /* ************************************* *
  *          DEBUG CONFIGURATION          *
  * ************************************* */
 
-#ifdef SMTD_DEBUG_ENABLED
+#if defined(SMTD_DEBUG_ENABLED) || defined(SMTD_LATENCY_STATS) || defined(SMTD_TIMEOUTS_DUMP)
 __attribute__((weak)) char *keycode_to_string_user(uint16_t keycode);
 
 char *keycode_to_string(uint16_t keycode) {
@@ -83,12 +122,101 @@ char *keycode_to_string(uint16_t keycode) {
         }
     }
 
+#    ifdef SMTD_ACTIONS
+    // macro keys described by the keymap are known by name
+#        define SMTD_ACTION_NAME(macro_key, kind, tap_key, mod_or_layer, threshold, use_cl) \
+            case macro_key:                                                                 \
+                return #macro_key;
+    switch (keycode) {
+        SMTD_ACTIONS(SMTD_ACTION_NAME)
+    }
+#    endif
+#    ifdef SMTD_POSITIONS
+#        define SMTD_POSITION_KEYCODE_NAME(name, kind, mod_or_layer, threshold, use_cl) \
+            case SMTD_POSITION_KEYCODE(name):                                        \
+                return #name;
+    switch (keycode) {
+        SMTD_POSITIONS(SMTD_POSITION_KEYCODE_NAME)
+    }
+#    endif
+
     static char buffer[16];
     snprintf(buffer, sizeof(buffer), "KC_%d", keycode);
     return buffer;
 }
 #endif
 
+/* ************************************* *
+ *                TRACE                  *
+ * ************************************* */
+
+// With SMTD_TRACE defined, sm_td writes a fixed-size binary record for every key event, stage
+// change, action, timeout and report into a RAM ring, instead of formatting anything on the fly.
+// A record is a few stores, so the trace can stay on while typing. smtd_trace_dump() prints the ring
+// as hex to the console, and sm_td_trace.py decodes it on the host.
+
+typedef enum {
+    /** A key event reached sm_td. arg: bit 0 pressed, bit 1 replayed. key: row << 4 | col */
+    SMTD_TRACE_EVENT,
+    /** A state changed stage. keycode: the macro key. stages: from << 4 | to */
+    SMTD_TRACE_STAGE,
+    /** An action ran. keycode: the macro key. arg: smtd_action. stages: the current stage */
+    SMTD_TRACE_ACTION,
+    /** A stage timeout fired. keycode: the macro key. arg: 1 when fired by a later event. stages: the current stage */
+    SMTD_TRACE_TIMEOUT,
+    /** A report went to the host. arg: mods. keycode: the first two keys */
+    SMTD_TRACE_REPORT,
+} smtd_trace_type;
+
+#ifdef SMTD_TRACE
+#    ifndef SMTD_TRACE_SIZE
+#        define SMTD_TRACE_SIZE 128
+#    endif
+
+_Static_assert((SMTD_TRACE_SIZE & (SMTD_TRACE_SIZE - 1)) == 0, "sm_td: SMTD_TRACE_SIZE must be a power of two");
+
+typedef struct {
+    /** Milliseconds since the previous record, modulo 65536 */
+    uint16_t delta;
+    uint16_t keycode;
+    uint8_t  type;
+    uint8_t  arg;
+    uint8_t  stages;
+    uint8_t  key;
+} smtd_trace_record;
+
+static smtd_trace_record smtd_trace_ring[SMTD_TRACE_SIZE];
+static uint16_t          smtd_trace_head = 0;
+/** Records in the ring, up to SMTD_TRACE_SIZE, kept apart from the head that wraps at 65536 */
+static uint16_t          smtd_trace_filled = 0;
+static uint16_t          smtd_trace_time   = 0;
+
+static void smtd_trace(smtd_trace_type type, uint16_t keycode, uint8_t arg, uint8_t stages, uint8_t key) {
+    uint16_t now     = timer_read();
+    uint16_t delta   = now - smtd_trace_time;
+    smtd_trace_time  = now;
+    smtd_trace_ring[smtd_trace_head++ & (SMTD_TRACE_SIZE - 1)] = (smtd_trace_record){delta, keycode, type, arg, stages, key};
+    if (smtd_trace_filled < SMTD_TRACE_SIZE) {
+        smtd_trace_filled++;
+    }
+}
+
+/** Prints the ring, oldest record first, as lines sm_td_trace.py understands */
+void smtd_trace_dump(void) {
+    uint16_t count = smtd_trace_filled;
+    printf("smtd-trace begin %04X %u\n", SMTD_KEYCODES_BEGIN, count);
+    for (uint16_t i = smtd_trace_head - count; i != smtd_trace_head; i++) {
+        smtd_trace_record *record = &smtd_trace_ring[i & (SMTD_TRACE_SIZE - 1)];
+        printf("smtd-trace %04X %04X %02X %02X %02X %02X\n", record->delta, record->keycode, record->type, record->arg, record->stages, record->key);
+    }
+    printf("smtd-trace end\n");
+}
+
+#    define SMTD_TRACE_RECORD(type, keycode, arg, stages, key) smtd_trace(type, keycode, arg, stages, key);
+#else
+#    define SMTD_TRACE_RECORD(type, keycode, arg, stages, key)
+#endif
+
 /* ************************************* *
  *       USER TIMEOUT DEFINITIONS        *
  * ************************************* */
@@ -98,6 +226,7 @@ typedef enum {
     SMTD_TIMEOUT_SEQUENCE,
     SMTD_TIMEOUT_FOLLOWING_TAP,
     SMTD_TIMEOUT_RELEASE,
+    SMTD_TIMEOUT_STREAK,
 } smtd_timeout;
 
 __attribute__((weak)) uint32_t get_smtd_timeout(uint16_t keycode, smtd_timeout timeout);
@@ -112,17 +241,302 @@ uint32_t get_smtd_timeout_default(smtd_timeout timeout) {
             return SMTD_GLOBAL_FOLLOWING_TAP_TERM;
         case SMTD_TIMEOUT_RELEASE:
             return SMTD_GLOBAL_RELEASE_TERM;
+        case SMTD_TIMEOUT_STREAK:
+            return SMTD_GLOBAL_STREAK_TERM;
     }
     return 0;
 }
 
-uint32_t get_smtd_timeout_or_default(uint16_t keycode, smtd_timeout timeout) {
+/** Keeps the global term in a SMTD_TIMEOUTS entry, so that 0 stays a timeout of its own */
+#define SMTD_DEFAULT_TIMEOUT 0xFFFF
+
+#ifdef SMTD_TIMEOUTS
+// The keymap may declare per-key timeouts instead of implementing get_smtd_timeout():
+//
+//   #define SMTD_TIMEOUTS(X) X(CKC_A, SMTD_GLOBAL_TAP_TERM * 2, SMTD_DEFAULT_TIMEOUT, SMTD_DEFAULT_TIMEOUT, 0, 100)
+//
+// with one X(keycode, tap, sequence, following_tap, release, streak) entry per key. Keys without an
+// entry, and the values of an entry set to SMTD_DEFAULT_TIMEOUT, keep the global terms. A position key
+// is listed by its SMTD_POSITION_KEYCODE(name). The table is built at compile time, a lookup is a
+// single indexed load. The values are stored plus one, so that the keys without an entry, left at 0
+// by the compiler, read as SMTD_DEFAULT_TIMEOUT.
+
+#    define SMTD_TIMEOUT_VALUE(value) (uint16_t)((value) + 1)
+#    define SMTD_TIMEOUT_ENTRY(keycode, tap, sequence, following_tap, release, streak) [SMTD_KEY_INDEX(keycode)] = {SMTD_TIMEOUT_VALUE(tap), SMTD_TIMEOUT_VALUE(sequence), SMTD_TIMEOUT_VALUE(following_tap), SMTD_TIMEOUT_VALUE(release), SMTD_TIMEOUT_VALUE(streak)},
+#    define SMTD_TIMEOUT_CHECK(keycode, tap, sequence, following_tap, release, streak) _Static_assert((tap) <= SMTD_DEFAULT_TIMEOUT && (sequence) <= SMTD_DEFAULT_TIMEOUT && (following_tap) <= SMTD_DEFAULT_TIMEOUT && (release) <= SMTD_DEFAULT_TIMEOUT && (streak) <= SMTD_DEFAULT_TIMEOUT, "sm_td: a timeout of " #keycode " doesn't fit 16 bits");
+
+SMTD_TIMEOUTS(SMTD_TIMEOUT_CHECK)
+
+static const uint16_t smtd_timeouts[SMTD_KEY_COUNT][SMTD_TIMEOUT_STREAK + 1] PROGMEM = {SMTD_TIMEOUTS(SMTD_TIMEOUT_ENTRY)};
+#endif
+
+static uint32_t smtd_configured_timeout(uint16_t keycode, smtd_timeout timeout) {
+#ifdef SMTD_TIMEOUTS
+    if (smtd_is_macro_key(keycode)) {
+        uint16_t value = pgm_read_word(&smtd_timeouts[SMTD_KEY_INDEX(keycode)][timeout]) - 1;
+        if (value != SMTD_DEFAULT_TIMEOUT) {
+            return value;
+        }
+    }
+#endif
     if (get_smtd_timeout) {
         return get_smtd_timeout(keycode, timeout);
     }
     return get_smtd_timeout_default(timeout);
 }
 
+/* ************************************* *
+ *          ADAPTIVE TAP TERMS           *
+ * ************************************* */
+
+#ifdef SMTD_ADAPTIVE_TERMS
+// sm_td learns how long each macro key is pressed when it resolves to a tap and when it resolves to
+// a hold. Both populations are tracked as exponentially weighted means and mean deviations, in
+// 1/16 ms fixed point. The tap term of a key is moved to the point between them, weighted by their
+// spread, and never closer than SMTD_ADAPTIVE_TAP_MARGIN deviations to the taps. The learned term
+// stays within SMTD_ADAPTIVE_MIN_PERCENT..SMTD_ADAPTIVE_MAX_PERCENT of the configured one.
+//
+// The statistics are stored in the EEPROM user datablock, at most once per SMTD_ADAPTIVE_SAVE_INTERVAL_MS,
+// so EECONFIG_USER_DATA_SIZE must leave room for them.
+
+#    include "eeconfig.h"
+
+#    ifndef SMTD_ADAPTIVE_MIN_SAMPLES
+#        define SMTD_ADAPTIVE_MIN_SAMPLES 16
+#    endif
+
+#    ifndef SMTD_ADAPTIVE_TAP_MARGIN
+#        define SMTD_ADAPTIVE_TAP_MARGIN 4
+#    endif
+
+#    ifndef SMTD_ADAPTIVE_MIN_PERCENT
+#        define SMTD_ADAPTIVE_MIN_PERCENT 50
+#    endif
+
+#    ifndef SMTD_ADAPTIVE_MAX_PERCENT
+#        define SMTD_ADAPTIVE_MAX_PERCENT 150
+#    endif
+
+#    ifndef SMTD_ADAPTIVE_SAVE_INTERVAL_MS
+#        define SMTD_ADAPTIVE_SAVE_INTERVAL_MS 600000
+#    endif
+
+#    ifndef SMTD_ADAPTIVE_EEPROM_OFFSET
+#        define SMTD_ADAPTIVE_EEPROM_OFFSET 0
+#    endif
+
+/** Longer presses are counted as this long, so that the fixed point values can't overflow */
+#    define SMTD_ADAPTIVE_SAMPLE_MAX 2000
+
+#    define SMTD_ADAPTIVE_KEYS SMTD_KEY_COUNT
+
+typedef struct {
+    /** Means and mean deviations of the press durations, in 1/16 ms */
+    uint16_t tap_mean;
+    uint16_t tap_dev;
+    uint16_t hold_mean;
+    uint16_t hold_dev;
+
+    /** The number of samples, saturating */
+    uint8_t taps;
+    uint8_t holds;
+} smtd_adaptive_stats;
+
+typedef struct {
+    /** Tells apart a stored block from garbage or from a block of another set of keys */
+    uint16_t            magic;
+    smtd_adaptive_stats keys[SMTD_ADAPTIVE_KEYS];
+} smtd_adaptive_store;
+
+#    define SMTD_ADAPTIVE_MAGIC (0x5D00 | SMTD_ADAPTIVE_KEYS)
+
+_Static_assert(SMTD_ADAPTIVE_EEPROM_OFFSET + sizeof(smtd_adaptive_store) <= EECONFIG_USER_DATA_SIZE, "sm_td: EECONFIG_USER_DATA_SIZE is too small for adaptive terms");
+
+static smtd_adaptive_store smtd_adaptive;
+
+/** The learned tap terms in ms, 0 until a key has enough samples of both kinds */
+static uint16_t smtd_adaptive_terms[SMTD_ADAPTIVE_KEYS];
+
+static bool     smtd_adaptive_loaded = false;
+static bool     smtd_adaptive_dirty  = false;
+static uint32_t smtd_adaptive_saved  = 0;
+
+static void smtd_adaptive_update_term(uint8_t key) {
+    smtd_adaptive_stats *stats = &smtd_adaptive.keys[key];
+    if (stats->taps < SMTD_ADAPTIVE_MIN_SAMPLES || stats->holds < SMTD_ADAPTIVE_MIN_SAMPLES) {
+        smtd_adaptive_terms[key] = 0;
+        return;
+    }
+
+    // the point where both populations are the same number of deviations away
+    uint32_t spread = (uint32_t)stats->tap_dev + stats->hold_dev;
+    uint32_t term   = spread ? ((uint32_t)stats->tap_mean * stats->hold_dev + (uint32_t)stats->hold_mean * stats->tap_dev) / spread : stats->tap_mean;
+
+    uint32_t margin = (uint32_t)stats->tap_mean + (uint32_t)SMTD_ADAPTIVE_TAP_MARGIN * stats->tap_dev;
+    if (term < margin) {
+        term = margin;
+    }
+    smtd_adaptive_terms[key] = term >> 4;
+}
+
+static void smtd_adaptive_track(uint16_t *mean, uint16_t *dev, uint8_t *count, uint16_t duration) {
+    if (duration > SMTD_ADAPTIVE_SAMPLE_MAX) {
+        duration = SMTD_ADAPTIVE_SAMPLE_MAX;
+    }
+    int32_t sample = (int32_t)duration << 4;
+
+    if (*count == 0) {
+        // the first sample seeds the mean, the deviation starts at a quarter of it
+        *mean = sample;
+        *dev  = sample / 4;
+    } else {
+        int32_t diff = sample - *mean;
+        *mean += diff / 16;
+        *dev += ((diff < 0 ? -diff : diff) - (int32_t)*dev) / 16;
+    }
+    if (*count < UINT8_MAX) {
+        (*count)++;
+    }
+}
+
+void smtd_adaptive_record(uint16_t keycode, bool tap, uint16_t duration) {
+    if (!smtd_is_macro_key(keycode) || !smtd_adaptive_loaded) {
+        return;
+    }
+
+    uint8_t              key   = SMTD_KEY_INDEX(keycode);
+    smtd_adaptive_stats *stats = &smtd_adaptive.keys[key];
+    if (tap) {
+        smtd_adaptive_track(&stats->tap_mean, &stats->tap_dev, &stats->taps, duration);
+    } else {
+        smtd_adaptive_track(&stats->hold_mean, &stats->hold_dev, &stats->holds, duration);
+    }
+    smtd_adaptive_update_term(key);
+    smtd_adaptive_dirty = true;
+}
+
+void smtd_adaptive_task(void) {
+    if (!smtd_adaptive_loaded) {
+        eeconfig_read_user_datablock(&smtd_adaptive, SMTD_ADAPTIVE_EEPROM_OFFSET, sizeof(smtd_adaptive));
+        if (smtd_adaptive.magic != SMTD_ADAPTIVE_MAGIC) {
+            memset(&smtd_adaptive, 0, sizeof(smtd_adaptive));
+            smtd_adaptive.magic = SMTD_ADAPTIVE_MAGIC;
+        }
+        for (uint8_t key = 0; key < SMTD_ADAPTIVE_KEYS; key++) {
+            smtd_adaptive_update_term(key);
+        }
+        smtd_adaptive_loaded = true;
+        smtd_adaptive_saved  = timer_read32();
+        return;
+    }
+
+    if (smtd_adaptive_dirty && timer_elapsed32(smtd_adaptive_saved) >= SMTD_ADAPTIVE_SAVE_INTERVAL_MS) {
+        eeconfig_update_user_datablock(&smtd_adaptive, SMTD_ADAPTIVE_EEPROM_OFFSET, sizeof(smtd_adaptive));
+        smtd_adaptive_dirty = false;
+        smtd_adaptive_saved = timer_read32();
+    }
+}
+
+/** Forgets everything learned, e.g. from a keycode bound to a key */
+void smtd_adaptive_reset(void) {
+    memset(&smtd_adaptive, 0, sizeof(smtd_adaptive));
+    smtd_adaptive.magic = SMTD_ADAPTIVE_MAGIC;
+    memset(smtd_adaptive_terms, 0, sizeof(smtd_adaptive_terms));
+    smtd_adaptive_dirty = true;
+}
+
+static uint32_t smtd_adaptive_term(uint16_t keycode, uint32_t configured) {
+    if (!smtd_is_macro_key(keycode)) {
+        return configured;
+    }
+
+    uint32_t learned = smtd_adaptive_terms[SMTD_KEY_INDEX(keycode)];
+    if (!learned) {
+        return configured;
+    }
+
+    uint32_t min = configured * SMTD_ADAPTIVE_MIN_PERCENT / 100;
+    uint32_t max = configured * SMTD_ADAPTIVE_MAX_PERCENT / 100;
+    return learned < min ? min : learned > max ? max : learned;
+}
+#endif
+
+uint32_t get_smtd_timeout_or_default(uint16_t keycode, smtd_timeout timeout) {
+    uint32_t configured = smtd_configured_timeout(keycode, timeout);
+#ifdef SMTD_ADAPTIVE_TERMS
+    if (timeout == SMTD_TIMEOUT_TAP) {
+        return smtd_adaptive_term(keycode, configured);
+    }
+#endif
+    return configured;
+}
+
+#ifdef SMTD_TIMEOUTS_DUMP
+// Prints the timeouts in effect for every macro key, from SMTD_TIMEOUTS, get_smtd_timeout() or the
+// global terms, and with the learned tap terms when SMTD_ADAPTIVE_TERMS is on. CONSOLE_ENABLE is
+// needed as well.
+
+void smtd_timeouts_dump(void) {
+    printf("%-16s %6s %8s %9s %7s %6s\n", "sm_td timeouts", "tap", "sequence", "following", "release", "streak");
+    for (uint8_t key = 0; key < SMTD_KEY_COUNT; key++) {
+        uint16_t keycode = smtd_key_keycode(key);
+        printf("%-16s", keycode_to_string(keycode));
+        printf(" %6u", (unsigned)get_smtd_timeout_or_default(keycode, SMTD_TIMEOUT_TAP));
+        printf(" %8u", (unsigned)get_smtd_timeout_or_default(keycode, SMTD_TIMEOUT_SEQUENCE));
+        printf(" %9u", (unsigned)get_smtd_timeout_or_default(keycode, SMTD_TIMEOUT_FOLLOWING_TAP));
+        printf(" %7u", (unsigned)get_smtd_timeout_or_default(keycode, SMTD_TIMEOUT_RELEASE));
+        printf(" %6u\n", (unsigned)get_smtd_timeout_or_default(keycode, SMTD_TIMEOUT_STREAK));
+    }
+}
+#endif
+
+/* ************************************* *
+ *          USER BIGRAM ROLLS            *
+ * ************************************* */
+
+#ifdef SMTD_BIGRAM_ROLLS
+// The keymap may list common rolls, usually generated from a text corpus by sm_td_bigrams.py:
+//
+//   #define SMTD_BIGRAM_ROLLS(X) X(CKC_S, SMTD_BIGRAM_BIT(CKC_T) | SMTD_BIGRAM_BIT(KC_W))
+//
+// with one X(macro_key, following_keys) entry per macro key. A following key is a letter or another
+// macro key. When it is pressed while the macro key is touched, the macro key is tapped right away
+// instead of waiting for the following key to be released.
+
+/** Letters take the low bits of a row, macro keys follow them */
+#    define SMTD_BIGRAM_BIT_INDEX(keycode) ((uint16_t)(keycode) > SMTD_KEYCODES_BEGIN ? (keycode) - SMTD_KEYCODES_BEGIN - 1 + 26 : (keycode) - KC_A)
+#    define SMTD_BIGRAM_BIT(keycode) ((uint64_t)1 << SMTD_BIGRAM_BIT_INDEX(keycode))
+#    define SMTD_BIGRAM_ENTRY(macro_key, following_keys) [macro_key - SMTD_KEYCODES_BEGIN - 1] = following_keys,
+
+_Static_assert(26 + SMTD_KEYCODES_END - SMTD_KEYCODES_BEGIN - 1 <= 64, "sm_td: bigram rows are 64 bits wide");
+
+static const uint64_t smtd_bigram_rolls[SMTD_KEYCODES_END - SMTD_KEYCODES_BEGIN - 1] PROGMEM = {SMTD_BIGRAM_ROLLS(SMTD_BIGRAM_ENTRY)};
+
+static inline bool smtd_bigram_roll(uint16_t macro_keycode, uint16_t following_keycode) {
+    if (macro_keycode >= SMTD_KEYCODES_END) {
+        // position keys have no rolls
+        return false;
+    }
+#    ifdef SMTD_POSITIONS
+    if (SMTD_POSITION_KEYCODES_BEGIN <= following_keycode && following_keycode <= QK_USER_MAX) {
+        following_keycode = smtd_position_tap_key(following_keycode);
+    }
+#    endif
+    if (!((KC_A <= following_keycode && following_keycode <= KC_Z) || (SMTD_KEYCODES_BEGIN < following_keycode && following_keycode < SMTD_KEYCODES_END))) {
+        return false;
+    }
+
+    // a single byte of the row is loaded, the targets are little endian
+    uint8_t        bit = SMTD_BIGRAM_BIT_INDEX(following_keycode);
+    const uint8_t *row = (const uint8_t *)&smtd_bigram_rolls[macro_keycode - SMTD_KEYCODES_BEGIN - 1];
+    return pgm_read_byte(row + (bit >> 3)) & (1 << (bit & 7));
+}
+#else
+static inline bool smtd_bigram_roll(uint16_t macro_keycode, uint16_t following_keycode) {
+    return false;
+}
+#endif
+
 /* ************************************* *
  *    USER FEATURE FLAGS DEFINITIONS     *
  * ************************************* */
@@ -141,159 +555,1108 @@ bool smtd_feature_enabled_default(smtd_feature feature) {
         case SMTD_FEATURE_AGGREGATE_TAPS:
             return SMTD_GLOBAL_AGGREGATE_TAPS;
     }
-    return false;
-}
+    return false;
+}
+
+bool smtd_feature_enabled_or_default(uint16_t keycode, smtd_feature feature) {
+    if (smtd_feature_enabled) {
+        return smtd_feature_enabled(keycode, feature);
+    }
+    return smtd_feature_enabled_default(feature);
+}
+
+// The flags of a key are resolved once, when its state is created, into a bitset kept in the state,
+// so the tap and sequence paths test a bit instead of calling smtd_feature_enabled() every time.
+// Without a user override the bitset is a compile time constant.
+
+#define SMTD_FEATURE_BIT(feature) (1 << (feature))
+#define SMTD_DEFAULT_FEATURES ((SMTD_GLOBAL_MODS_RECALL ? SMTD_FEATURE_BIT(SMTD_FEATURE_MODS_RECALL) : 0) | (SMTD_GLOBAL_AGGREGATE_TAPS ? SMTD_FEATURE_BIT(SMTD_FEATURE_AGGREGATE_TAPS) : 0))
+
+static uint8_t smtd_features_of(uint16_t keycode) {
+    if (!smtd_feature_enabled) {
+        return SMTD_DEFAULT_FEATURES;
+    }
+    uint8_t features = 0;
+    if (smtd_feature_enabled(keycode, SMTD_FEATURE_MODS_RECALL)) {
+        features |= SMTD_FEATURE_BIT(SMTD_FEATURE_MODS_RECALL);
+    }
+    if (smtd_feature_enabled(keycode, SMTD_FEATURE_AGGREGATE_TAPS)) {
+        features |= SMTD_FEATURE_BIT(SMTD_FEATURE_AGGREGATE_TAPS);
+    }
+    return features;
+}
+
+#define SMTD_HAS_FEATURE(state, feature) ((state)->features & SMTD_FEATURE_BIT(feature))
+
+/* ************************************* *
+ *       USER ACTION DEFINITIONS         *
+ * ************************************* */
+
+typedef enum {
+    SMTD_ACTION_TOUCH,
+    SMTD_ACTION_TAP,
+    SMTD_ACTION_HOLD,
+    SMTD_ACTION_RELEASE,
+} smtd_action;
+
+#ifdef SMTD_DEBUG_ENABLED
+char *smtd_action_to_string(smtd_action action) {
+    switch (action) {
+        case SMTD_ACTION_TOUCH:
+            return "ACT_TOUCH";
+        case SMTD_ACTION_TAP:
+            return "ACT_TAP";
+        case SMTD_ACTION_HOLD:
+            return "ACT_HOLD";
+        case SMTD_ACTION_RELEASE:
+            return "ACT_RELEASE";
+    }
+    return "ACT_UNKNOWN";
+}
+#endif
+
+__attribute__((weak)) void on_smtd_action(uint16_t keycode, smtd_action action, uint8_t sequence_len);
+
+typedef enum {
+    SMTD_KIND_NONE,
+    SMTD_KIND_MT,
+    SMTD_KIND_MTE,
+    SMTD_KIND_LT,
+} smtd_kind;
+
+/** What a macro key does, the table form of the SMTD_MT, SMTD_MTE and SMTD_LT macros */
+typedef struct {
+    /** The key tapped, and held once the sequence reaches the threshold */
+    uint16_t tap_key;
+
+    /** Taps in a row after which a hold holds the tap key instead */
+    uint16_t threshold;
+
+    /** smtd_kind, SMTD_KIND_NONE leaves the key to on_smtd_action() */
+    uint8_t kind;
+
+    /** The modifier keycode for SMTD_KIND_MT and SMTD_KIND_MTE, the layer for SMTD_KIND_LT */
+    uint8_t mod_or_layer;
+
+    /** Whether the tap key is shifted while caps word is on */
+    bool use_cl;
+} smtd_action_descriptor;
+
+#ifdef SMTD_ACTIONS
+// The keymap may describe its macro keys instead of implementing on_smtd_action():
+//
+//   #define SMTD_ACTIONS(X) X(CKC_A, SMTD_KIND_MT, KC_A, KC_LEFT_ALT, 1000, true)
+//
+// with one X(keycode, kind, tap_key, mod_or_layer, threshold, use_cl) entry per key, keys without an
+// entry go to on_smtd_action(). An action loads the descriptor of its key and runs it in
+// smtd_execute_action(), there is no switch over the keycodes.
+
+#    define SMTD_ACTION_ENTRY(keycode, kind, tap_key, mod_or_layer, threshold, use_cl) [keycode - SMTD_KEYCODES_BEGIN - 1] = {tap_key, threshold, kind, mod_or_layer, use_cl},
+
+static const smtd_action_descriptor smtd_action_descriptors[SMTD_KEYCODES_END - SMTD_KEYCODES_BEGIN - 1] PROGMEM = {SMTD_ACTIONS(SMTD_ACTION_ENTRY)};
+#endif
+
+/* ************************************* *
+ *            POSITION KEYS              *
+ * ************************************* */
+
+#ifdef SMTD_POSITIONS
+// The keymap may make plain keys of its layout tap-hold keys by their position, without a custom
+// keycode for each of them. The entries describe the keys:
+//
+//   #define SMTD_POSITIONS(X) X(PTR_Z, SMTD_KIND_LT, LAYER_POINTER, 1000, true)
+//
+// with one X(name, kind, mod_or_layer, threshold, use_cl) entry per key, and a map puts them in the
+// layout, like the keymap itself:
+//
+//   const uint8_t PROGMEM smtd_position_map[][MATRIX_ROWS][MATRIX_COLS] = {
+//       [LAYER_BASE] = LAYOUT(SMTD_POSITION(PTR_Z), 0, ...),
+//   };
+//   const uint8_t smtd_position_layers = ARRAY_SIZE(smtd_position_map);
+//
+// The tap key is the keycode of the layout where the entry sits, so another layer may reuse a key
+// with an entry of its own. A press is looked up in the map of the layer it is taken from, a single
+// byte read, and the event is handled as SMTD_POSITION_KEYCODE(name) from then on. A release is looked
+// up on the layer of its press, like QMK does for keycodes. An entry must sit at a single position.
+
+/** The value of an entry in smtd_position_map, 0 leaves the key alone */
+#    define SMTD_POSITION(name) (SMTD_POSITION_##name + 1)
+#    define SMTD_POSITION_ACTION_ENTRY(name, kind, mod_or_layer, threshold, use_cl) {KC_NO, threshold, kind, mod_or_layer, use_cl},
+
+_Static_assert(SMTD_POSITION_COUNT < UINT8_MAX, "sm_td: too many SMTD_POSITIONS entries");
+
+extern const uint8_t smtd_position_map[][MATRIX_ROWS][MATRIX_COLS] PROGMEM;
+extern const uint8_t smtd_position_layers;
+
+/** The descriptors of the entries, their tap key is read from the layout */
+static const smtd_action_descriptor smtd_position_actions[SMTD_POSITION_COUNT] PROGMEM = {SMTD_POSITIONS(SMTD_POSITION_ACTION_ENTRY)};
+
+typedef struct {
+    uint8_t  layer;
+    keypos_t key;
+} smtd_position;
+
+/** Where each entry was last pressed, which is where its tap key is read from */
+static smtd_position smtd_positions[SMTD_POSITION_COUNT];
+
+/** The keycode sm_td handles an event as, the SMTD_POSITION_KEYCODE() of the entry at its position or its own keycode */
+static uint16_t smtd_position_keycode(uint16_t keycode, keyrecord_t *record) {
+    keypos_t key = record->event.key;
+    if (key.row >= MATRIX_ROWS || key.col >= MATRIX_COLS) {
+        // combos and encoders are not in the matrix
+        return keycode;
+    }
+
+    uint8_t layer = record->event.pressed ? layer_switch_get_layer(key) : read_source_layers_cache(key);
+    if (layer >= smtd_position_layers) {
+        return keycode;
+    }
+    uint8_t entry = pgm_read_byte(&smtd_position_map[layer][key.row][key.col]);
+    if (!entry) {
+        return keycode;
+    }
+    smtd_positions[entry - 1] = (smtd_position){layer, key};
+    return SMTD_POSITION_KEYCODES_BEGIN + entry - 1;
+}
+
+static uint16_t smtd_position_tap_key(uint16_t keycode) {
+    smtd_position *position = &smtd_positions[keycode - SMTD_POSITION_KEYCODES_BEGIN];
+    return keymap_key_to_keycode(position->layer, position->key);
+}
+#else
+static inline uint16_t smtd_position_keycode(uint16_t keycode, keyrecord_t *record) {
+    return keycode;
+}
+#endif
+
+void smtd_execute_action(uint16_t keycode, smtd_action action, uint8_t sequence_len);
+
+#ifdef SMTD_LATENCY_STATS
+void smtd_latency_action(uint16_t keycode, smtd_action action, uint16_t elapsed);
+#    define SMTD_LATENCY_ACTION(action, state) smtd_latency_action(state->macro_keycode, action, timer_elapsed(state->pressed_at));
+#else
+#    define SMTD_LATENCY_ACTION(action, state)
+#endif
+
+#ifdef SMTD_DEBUG_ENABLED
+#    define SMTD_ACTION(action, state)                                                                                                          \
+        printf("%s by %s in %s\n", smtd_action_to_string(action), keycode_to_string(state->macro_keycode), smtd_stage_to_string(state->stage)); \
+        SMTD_TRACE_RECORD(SMTD_TRACE_ACTION, state->macro_keycode, action, state->stage, 0)                                                     \
+        SMTD_LATENCY_ACTION(action, state)                                                                                                      \
+        smtd_execute_action(state->macro_keycode, action, state->sequence_len);
+#else
+#    define SMTD_ACTION(action, state)                                                      \
+        SMTD_TRACE_RECORD(SMTD_TRACE_ACTION, state->macro_keycode, action, state->stage, 0) \
+        SMTD_LATENCY_ACTION(action, state)                                                  \
+        smtd_execute_action(state->macro_keycode, action, state->sequence_len);
+#endif
+
+/* ************************************* *
+ *       USER STATES DEFINITIONS         *
+ * ************************************* */
+
+typedef enum {
+    SMTD_STAGE_NONE,
+    SMTD_STAGE_TOUCH,
+    SMTD_STAGE_SEQUENCE,
+    SMTD_STAGE_FOLLOWING_TOUCH,
+    SMTD_STAGE_HOLD,
+    SMTD_STAGE_RELEASE,
+} smtd_stage;
+
+#if defined(SMTD_DEBUG_ENABLED) || defined(SMTD_LATENCY_STATS)
+char *smtd_stage_to_string(smtd_stage stage) {
+    switch (stage) {
+        case SMTD_STAGE_NONE:
+            return "STAGE_NONE";
+        case SMTD_STAGE_TOUCH:
+            return "STAGE_TOUCH";
+        case SMTD_STAGE_SEQUENCE:
+            return "STAGE_SEQUENCE";
+        case SMTD_STAGE_FOLLOWING_TOUCH:
+            return "STAGE_FOL_TOUCH";
+        case SMTD_STAGE_HOLD:
+            return "STAGE_HOLD";
+        case SMTD_STAGE_RELEASE:
+            return "STAGE_RELEASE";
+    }
+    return "STAGE_UNKNOWN";
+}
+#endif
+
+typedef struct {
+    /** The keycode of the macro key */
+    uint16_t macro_keycode;
+
+    /** The mods before the touch action performed. Required for mod_recall feature */
+    uint8_t modes_before_touch;
+
+    /** Since touch can modify global mods, we need to save them separately to correctly restore a state before touch */
+    uint8_t modes_with_touch;
+
+    /** The length of the sequence of same key taps */
+    uint8_t sequence_len;
+
+    /** The smtd_feature flags of the macro key, one SMTD_FEATURE_BIT each, resolved when the state is created */
+    uint8_t features;
+
+    /** The position of key that was pressed after macro was pressed */
+    keypos_t following_key;
+
+    /** The keycode of the key that was pressed after macro was pressed */
+    uint16_t following_keycode;
+
+    /** The time stamp of the press of the following key, its replayed press carries it */
+    uint16_t following_at;
+
+    /** The time of the last macro key press */
+    uint16_t pressed_at;
+
+    /** How long the macro key was held, set when it is released before the state is resolved */
+    uint16_t press_duration;
+
+    /** The deadline of current stage timeout, only meaningful while the slot is in smtd_timer_slots */
+    uint32_t deadline;
+
+    /** The current stage of the state */
+    smtd_stage stage;
+
+    /** Bumped every time the slot is freed, so timeouts of a previous owner can tell they are stale */
+    uint8_t generation;
+
+    /** The next slot of the free list, only meaningful while the slot is free */
+    uint8_t next_free;
+
+#ifdef SMTD_LATENCY_STATS
+    /** The time the current stage was entered */
+    uint16_t stage_at;
+#endif
+} smtd_state;
+
+#define EMPTY_STATE {.macro_keycode = 0, .modes_before_touch = 0, .modes_with_touch = 0, .sequence_len = 0, .features = 0, .following_key = MAKE_KEYPOS(0, 0), .following_keycode = 0, .following_at = 0, .pressed_at = 0, .press_duration = 0, .deadline = 0, .stage = SMTD_STAGE_NONE, .generation = 0, .next_free = 0}
+
+/* ************************************* *
+ *             LAYER UTILS               *
+ * ************************************* */
+
+// The layers held by LT keys form a stack owned by sm_td. Every hold pushes an entry tagged with its
+// macro key, and its release removes that entry wherever it is in the stack, so overlapping holds
+// may be released in any order. An entry only turns its own layer on with layer_on(), and only when
+// the layer was off, and its release turns that layer off again with layer_off() once no other
+// entry holds it. Layers switched by anything else, MO() keys or the default layer, stay as they are.
+
+#ifndef SMTD_LAYER_STACK_SIZE
+#    define SMTD_LAYER_STACK_SIZE 4
+#endif
+
+typedef struct {
+    /** The macro key whose hold pushed the entry */
+    uint16_t owner;
+    uint8_t  layer;
+    /** The entry turned its layer on, and turns it off when released */
+    bool owned;
+} smtd_layer_entry;
+
+static smtd_layer_entry smtd_layer_stack[SMTD_LAYER_STACK_SIZE];
+static uint8_t          smtd_layer_depth = 0;
+
+/** The number of holds that didn't switch layer because the stack was full */
+uint16_t smtd_layer_overflows = 0;
+
+void smtd_layer_push(uint16_t owner, uint8_t layer) {
+    if (smtd_layer_depth == SMTD_LAYER_STACK_SIZE) {
+        smtd_layer_overflows++;
+        return;
+    }
+    bool owned = !layer_state_is(layer);
+    smtd_layer_stack[smtd_layer_depth++] = (smtd_layer_entry){owner, layer, owned};
+    if (owned) {
+        layer_on(layer);
+    }
+}
+
+void smtd_layer_pop(uint16_t owner) {
+    uint8_t i = smtd_layer_depth;
+    while (i > 0 && smtd_layer_stack[i - 1].owner != owner) {
+        i--;
+    }
+    if (i == 0) {
+        // the push overflowed, or the owner never held its layer
+        return;
+    }
+    smtd_layer_entry entry = smtd_layer_stack[i - 1];
+    memmove(&smtd_layer_stack[i - 1], &smtd_layer_stack[i], (smtd_layer_depth - i) * sizeof(smtd_layer_entry));
+    smtd_layer_depth--;
+    if (!entry.owned) {
+        return;
+    }
+    for (uint8_t j = 0; j < smtd_layer_depth; j++) {
+        if (smtd_layer_stack[j].layer == entry.layer) {
+            // another hold of the same layer keeps it on, and turns it off in turn
+            smtd_layer_stack[j].owned = true;
+            return;
+        }
+    }
+    layer_off(entry.layer);
+}
+
+// For on_smtd_action(), the entry belongs to the keycode of the action
+#define LAYER_PUSH(layer) smtd_layer_push(keycode, layer);
+#define LAYER_RESTORE() smtd_layer_pop(keycode);
+
+/* ************************************* *
+ *            LATENCY STATS              *
+ * ************************************* */
+
+#ifdef SMTD_LATENCY_STATS
+// Log2 histograms, per macro key, of how long after its press the tap or hold action fires, and of
+// how long its state stays in every stage. Bucket 0 counts 0 ms, bucket n counts 2^(n-1) ms up to
+// 2^n - 1 ms, and the last bucket everything above. They take 7 * SMTD_LATENCY_BUCKETS * 2 bytes of
+// RAM per key. smtd_latency_dump() prints them to the console, so CONSOLE_ENABLE is needed as well.
+
+#    ifndef SMTD_LATENCY_BUCKETS
+#        define SMTD_LATENCY_BUCKETS 12
+#    endif
+
+typedef uint16_t smtd_latency_histogram[SMTD_LATENCY_BUCKETS];
+
+/** Press to action delay, indexed by SMTD_KEY_INDEX(), then 0 for TAP and 1 for HOLD */
+static smtd_latency_histogram smtd_latency_actions[SMTD_KEY_COUNT][2];
+
+/** Time spent in a stage, indexed by SMTD_KEY_INDEX(), then by smtd_stage counted from SMTD_STAGE_TOUCH */
+static smtd_latency_histogram smtd_latency_stages[SMTD_KEY_COUNT][SMTD_STAGE_RELEASE];
+
+static void smtd_latency_count(smtd_latency_histogram histogram, uint16_t elapsed) {
+    uint8_t bucket = elapsed ? 32 - __builtin_clz(elapsed) : 0;
+    if (bucket >= SMTD_LATENCY_BUCKETS) {
+        bucket = SMTD_LATENCY_BUCKETS - 1;
+    }
+    if (histogram[bucket] < UINT16_MAX) {
+        histogram[bucket]++;
+    }
+}
+
+void smtd_latency_action(uint16_t keycode, smtd_action action, uint16_t elapsed) {
+    if ((action == SMTD_ACTION_TAP || action == SMTD_ACTION_HOLD) && smtd_is_macro_key(keycode)) {
+        smtd_latency_count(smtd_latency_actions[SMTD_KEY_INDEX(keycode)][action == SMTD_ACTION_HOLD], elapsed);
+    }
+}
+
+static void smtd_latency_stage(smtd_state *state) {
+    if (state->stage != SMTD_STAGE_NONE) {
+        smtd_latency_count(smtd_latency_stages[SMTD_KEY_INDEX(state->macro_keycode)][state->stage - SMTD_STAGE_TOUCH], timer_elapsed(state->stage_at));
+    }
+    state->stage_at = timer_read();
+}
+
+static void smtd_latency_print(const char *name, const char *kind, smtd_latency_histogram histogram) {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < SMTD_LATENCY_BUCKETS; i++) {
+        total += histogram[i];
+    }
+    if (!total) {
+        return;
+    }
+
+    printf("%-10s %-16s", name, kind);
+    for (uint8_t i = 0; i < SMTD_LATENCY_BUCKETS; i++) {
+        printf(" %5u", histogram[i]);
+    }
+    printf("\n");
+}
+
+extern uint16_t smtd_late_resolutions;
+
+void smtd_latency_dump(void) {
+    printf("sm_td stage timeouts fired late by an event: %u\n", smtd_late_resolutions);
+    printf("sm_td latency, ms from          0");
+    for (uint8_t i = 1; i < SMTD_LATENCY_BUCKETS; i++) {
+        printf(" %5u", 1u << (i - 1));
+    }
+    printf("\n");
+
+    for (uint8_t key = 0; key < SMTD_KEY_COUNT; key++) {
+        char *name = keycode_to_string(smtd_key_keycode(key));
+        smtd_latency_print(name, "tap", smtd_latency_actions[key][0]);
+        smtd_latency_print(name, "hold", smtd_latency_actions[key][1]);
+        for (uint8_t stage = SMTD_STAGE_TOUCH; stage <= SMTD_STAGE_RELEASE; stage++) {
+            smtd_latency_print(name, smtd_stage_to_string(stage), smtd_latency_stages[key][stage - SMTD_STAGE_TOUCH]);
+        }
+    }
+}
+
+void smtd_latency_reset(void) {
+    memset(smtd_latency_actions, 0, sizeof(smtd_latency_actions));
+    memset(smtd_latency_stages, 0, sizeof(smtd_latency_stages));
+}
+#endif
+
+/* ************************************* *
+ *      CORE LOGIC IMPLEMENTATION        *
+ * ************************************* */
+
+/* ************************************* *
+ *              STATE POOL               *
+ * ************************************* */
+
+#ifndef SMTD_POOL_SIZE
+#    define SMTD_POOL_SIZE 10
+#endif
+
+_Static_assert(SMTD_POOL_SIZE <= 16, "sm_td: slot masks are 16 bits wide");
+
+#define SMTD_NO_SLOT 0xFF
+#define SMTD_SLOT_BIT(idx) ((uint16_t)1 << (idx))
+
+// States live in fixed slots and never move, so a pointer to a state stays valid until the state
+// is released. Released slots are chained into a free list, slots that were never used are handed
+// out from the high water mark, so the pool needs no initialization.
+
+smtd_state smtd_active_states[SMTD_POOL_SIZE];
+
+/** The number of live states */
+uint8_t smtd_active_states_size = 0;
+
+/** The slots holding live states */
+static uint16_t smtd_live_slots = 0;
+
+static uint8_t smtd_pool_high_water = 0;
+static uint8_t smtd_free_head       = SMTD_NO_SLOT;
+
+/** The number of macro key presses that were bypassed because the pool was full */
+uint16_t smtd_pool_overflows = 0;
+
+static inline uint8_t smtd_slot_of(smtd_state *state) {
+    return state - smtd_active_states;
+}
+
+static void smtd_replay_forget(uint8_t idx);
+
+smtd_state *smtd_pool_alloc(void) {
+    uint8_t idx;
+    if (smtd_free_head != SMTD_NO_SLOT) {
+        idx            = smtd_free_head;
+        smtd_free_head = smtd_active_states[idx].next_free;
+    } else if (smtd_pool_high_water < SMTD_POOL_SIZE) {
+        idx = smtd_pool_high_water++;
+    } else {
+        smtd_pool_overflows++;
+        return NULL;
+    }
+
+    smtd_live_slots |= SMTD_SLOT_BIT(idx);
+    smtd_active_states_size++;
+    return &smtd_active_states[idx];
+}
+
+void smtd_pool_free(smtd_state *state) {
+    uint8_t idx        = smtd_slot_of(state);
+    uint8_t generation = state->generation + 1;
+
+    *state            = (smtd_state)EMPTY_STATE;
+    state->generation = generation;
+    state->next_free  = smtd_free_head;
+    smtd_free_head    = idx;
+
+    smtd_live_slots &= ~SMTD_SLOT_BIT(idx);
+    smtd_active_states_size--;
+    smtd_replay_forget(idx);
+}
+
+/** Packs the slot and its generation into a handle */
+static inline uint16_t smtd_state_handle(smtd_state *state) {
+    return smtd_slot_of(state) | (uint16_t)state->generation << 8;
+}
+
+/** Resolves a handle back to its state, or NULL if the state has been released since */
+static inline smtd_state *smtd_state_from_handle(uint16_t handle) {
+    smtd_state *state = &smtd_active_states[handle & 0xFF];
+    if (state->generation != (uint8_t)(handle >> 8) || state->stage == SMTD_STAGE_NONE) {
+        return NULL;
+    }
+    return state;
+}
+
+/* ************************************* *
+ *           DISPATCH INDEX              *
+ * ************************************* */
+
+/** The slots that won't be offered the event being replayed, see REPLAY QUEUE */
+static uint16_t smtd_replay_skip = 0;
+
+// Every event used to be offered to every active state. The index below keeps track of which
+// states may react to which events, so process_smtd() only visits the states that care.
+
+/** States that react to any key press: TOUCH, SEQUENCE, FOLLOWING_TOUCH and RELEASE stages */
+static uint16_t smtd_press_slots = 0;
+
+/** States that wait for their following key to be released: FOLLOWING_TOUCH and RELEASE stages */
+static uint16_t smtd_following_slots = 0;
+
+/** Matrix positions of the following keys held by smtd_following_slots */
+static matrix_row_t smtd_following_rows[MATRIX_ROWS] = {0};
+
+/** Slot of the state owning a macro keycode, indexed by SMTD_KEY_INDEX() */
+static uint8_t smtd_keycode_slots[SMTD_KEY_COUNT] = {[0 ... SMTD_KEY_COUNT - 1] = SMTD_NO_SLOT};
+
+static inline uint8_t smtd_keycode_slot(uint16_t keycode) {
+    if (!smtd_is_macro_key(keycode)) {
+        return SMTD_NO_SLOT;
+    }
+    return smtd_keycode_slots[SMTD_KEY_INDEX(keycode)];
+}
+
+static inline bool smtd_is_following_position(keypos_t key) {
+    return (smtd_following_rows[key.row] & (MATRIX_ROW_SHIFTER << key.col)) != 0;
+}
+
+void smtd_index_update(uint8_t idx) {
+    smtd_state *state = &smtd_active_states[idx];
+    uint16_t    bit   = SMTD_SLOT_BIT(idx);
+
+    bool was_following = (smtd_following_slots & bit) != 0;
+    smtd_press_slots &= ~bit;
+    smtd_following_slots &= ~bit;
+
+    switch (state->stage) {
+        case SMTD_STAGE_TOUCH:
+        case SMTD_STAGE_SEQUENCE:
+            smtd_press_slots |= bit;
+            break;
+        case SMTD_STAGE_FOLLOWING_TOUCH:
+        case SMTD_STAGE_RELEASE:
+            smtd_press_slots |= bit;
+            smtd_following_slots |= bit;
+            smtd_following_rows[state->following_key.row] |= MATRIX_ROW_SHIFTER << state->following_key.col;
+            break;
+        case SMTD_STAGE_NONE:
+        case SMTD_STAGE_HOLD:
+            break;
+    }
+
+    if (was_following && !(smtd_following_slots & bit)) {
+        // the position may still be shared with another state, so rebuild its bit from the remaining ones
+        keypos_t key = state->following_key;
+        smtd_following_rows[key.row] &= ~(MATRIX_ROW_SHIFTER << key.col);
+        for (uint16_t slots = smtd_following_slots; slots; slots &= slots - 1) {
+            keypos_t other = smtd_active_states[__builtin_ctz(slots)].following_key;
+            smtd_following_rows[other.row] |= MATRIX_ROW_SHIFTER << other.col;
+        }
+    }
+}
+
+/** Returns the slots that may react to the event, shifted so that bit 0 is slot `from` */
+static inline uint16_t smtd_event_slots(uint16_t keycode, keyrecord_t *record, uint8_t from) {
+    uint16_t slots;
+    if (record->event.pressed) {
+        slots = smtd_press_slots;
+    } else {
+        uint8_t owner = smtd_keycode_slot(keycode);
+        slots         = owner == SMTD_NO_SLOT ? 0 : SMTD_SLOT_BIT(owner);
+        if (smtd_is_following_position(record->event.key)) {
+            slots |= smtd_following_slots;
+        }
+    }
+    return (slots & ~smtd_replay_skip) >> from;
+}
+
+/* ************************************* *
+ *               TIMEOUTS                *
+ * ************************************* */
+
+// Each state has at most one pending timeout, the one of its current stage, so the deadlines live
+// in the states themselves. Arming and cancelling only touch a bit in smtd_timer_slots, and
+// smtd_task() looks at the deadlines only once the earliest one is due.
+//
+// Deadlines count from when things happened, not from when sm_td got to them: from the time stamp
+// of the event being handled, or from the deadline of the timeout being fired. So neither the
+// transport delay of the split half nor a slow scan shifts a decision. An event stamped past a
+// pending deadline fires that timeout first, see process_smtd().
+
+/** Slots with a pending stage timeout */
+static uint16_t smtd_timer_slots = 0;
+
+/** A lower bound of the pending deadlines, exact unless the earliest timer was cancelled */
+static uint32_t smtd_timer_next = 0;
+
+/** The time the event or timeout being handled happened at, stage timeouts are armed from it */
+static uint32_t smtd_timer_now = 0;
+
+/** The number of stage timeouts fired by an event stamped past their deadline, before smtd_task() got to them */
+uint16_t smtd_late_resolutions = 0;
+
+/** The time stamp of an event on the timer_read32() scale, an event stamped ahead of the clock counts as now */
+static uint32_t smtd_event_time(keyrecord_t *record) {
+    uint32_t now = timer_read32();
+    uint16_t age = (uint16_t)now - record->event.time;
+    return age < 0x8000 ? now - age : now;
+}
+
+void smtd_timer_arm(smtd_state *state, uint32_t delay) {
+    state->deadline = smtd_timer_now + delay;
+    if (!smtd_timer_slots || timer_expired32(smtd_timer_next, state->deadline)) {
+        smtd_timer_next = state->deadline;
+    }
+    smtd_timer_slots |= SMTD_SLOT_BIT(smtd_slot_of(state));
+}
+
+static inline void smtd_timer_cancel(smtd_state *state) {
+    smtd_timer_slots &= ~SMTD_SLOT_BIT(smtd_slot_of(state));
+}
+
+/** How long the macro key of a state has been held at the time being handled */
+static inline uint16_t smtd_held_for(smtd_state *state) {
+    return (uint16_t)smtd_timer_now - state->pressed_at;
+}
+
+/** The number of pending stage timeouts */
+static inline uint8_t smtd_timers_outstanding(void) {
+    return __builtin_popcount(smtd_timer_slots);
+}
+
+/* ************************************* *
+ *             HOST REPORTS              *
+ * ************************************* */
+
+// sm_td wraps the send_keyboard of the host driver, so it sees the reports produced by its actions.
+// The driver is only set up after keyboard init and may be swapped later, so smtd_task() wraps it lazily.
+
+#ifndef SMTD_GLOBAL_COALESCE_REPORTS
+#    define SMTD_GLOBAL_COALESCE_REPORTS true
+#endif
+
+static host_driver_t  smtd_output_driver;
+static host_driver_t *smtd_host_driver = NULL;
+
+/** Set by SMTD_SIMULTANEOUS_PRESSES_DELAY, applies to the next report */
+static bool smtd_output_barrier = false;
+
+#if SMTD_GLOBAL_SIMULTANEOUS_PRESSES_DELAY_MS > 0
+// Some hosts drop key presses that come too close to each other. Rather than blocking in wait_ms(),
+// a report sent after a barrier is queued until the spacing has passed since the previous report,
+// and every report behind it waits in the queue to keep their order. The queue is drained by
+// smtd_task(), so scanning goes on during the gap.
+
+#    ifndef SMTD_OUTPUT_QUEUE_SIZE
+#        define SMTD_OUTPUT_QUEUE_SIZE 8
+#    endif
+
+typedef struct {
+    report_keyboard_t report;
+
+    /** The report has to wait for the spacing after the previous one */
+    bool spaced;
+} smtd_output_entry;
+
+static smtd_output_entry smtd_output_queue[SMTD_OUTPUT_QUEUE_SIZE];
+static uint8_t           smtd_output_head = 0;
+static uint8_t           smtd_output_len  = 0;
+
+static uint32_t smtd_output_last_sent = 0;
+
+/** The number of times the queue was full and had to be flushed without spacing */
+uint16_t smtd_output_overflows = 0;
+
+static void smtd_output_send(report_keyboard_t *report) {
+    smtd_host_driver->send_keyboard(report);
+    smtd_output_last_sent = timer_read32();
+}
+
+static inline bool smtd_output_ready(bool spaced) {
+    return !spaced || timer_elapsed32(smtd_output_last_sent) >= SMTD_GLOBAL_SIMULTANEOUS_PRESSES_DELAY_MS;
+}
+
+static void smtd_output_pop(void) {
+    smtd_output_send(&smtd_output_queue[smtd_output_head].report);
+    smtd_output_head = (smtd_output_head + 1) % SMTD_OUTPUT_QUEUE_SIZE;
+    smtd_output_len--;
+}
+
+static void smtd_output_schedule(report_keyboard_t *report, bool spaced) {
+    if (!smtd_output_len && smtd_output_ready(spaced)) {
+        smtd_output_send(report);
+        return;
+    }
+
+    if (smtd_output_len == SMTD_OUTPUT_QUEUE_SIZE) {
+        // keeping the order matters more than the spacing
+        smtd_output_overflows++;
+        while (smtd_output_len) {
+            smtd_output_pop();
+        }
+    }
+
+    smtd_output_entry *entry = &smtd_output_queue[(smtd_output_head + smtd_output_len) % SMTD_OUTPUT_QUEUE_SIZE];
+    entry->report            = *report;
+    entry->spaced            = spaced;
+    smtd_output_len++;
+}
+#endif
+
+// Mods recall makes a tap cost up to four reports: recalled mods, tap press, tap release and restored
+// mods. Reports produced inside a transaction are held back one at a time, and a held report is
+// dropped when the next one carries all of its changes without reordering them for the host. The
+// host applies the mods of a report before its keys, so a mods-only change can always be folded into
+// the next report, and a key release can be folded into a following mods-only change. A change
+// that the next report reverts is never dropped.
+
+typedef struct {
+    /** The number of taps resolved, and the reports they sent to the host */
+    uint32_t taps;
+    uint32_t tap_reports;
+
+    /** The number of holds resolved, and the reports they sent to the host */
+    uint32_t holds;
+    uint32_t hold_reports;
+} smtd_report_stats;
+
+smtd_report_stats smtd_reports = {0};
+
+/** The last report passed on to the host */
+static report_keyboard_t smtd_report_sent;
+
+static report_keyboard_t smtd_report_held;
+static bool              smtd_report_has_held    = false;
+static bool              smtd_report_held_spaced = false;
+
+static bool    smtd_report_transaction = false;
+static uint8_t smtd_report_count       = 0;
+
+static void smtd_report_emit(report_keyboard_t *report, bool spaced) {
+    smtd_report_sent = *report;
+    smtd_report_count++;
+    SMTD_TRACE_RECORD(SMTD_TRACE_REPORT, report->keys[0] | report->keys[1] << 8, report->mods, 0, 0)
+#if SMTD_GLOBAL_SIMULTANEOUS_PRESSES_DELAY_MS > 0
+    smtd_output_schedule(report, spaced);
+#else
+    (void)spaced;
+    smtd_host_driver->send_keyboard(report);
+#endif
+}
+
+static bool smtd_report_has_key(report_keyboard_t *report, uint8_t key) {
+    for (uint8_t i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+        if (report->keys[i] == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Checks that every key of `a` is in `b` */
+static bool smtd_report_keys_within(report_keyboard_t *a, report_keyboard_t *b) {
+    for (uint8_t i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+        if (a->keys[i] && !smtd_report_has_key(b, a->keys[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Checks whether `held` may be dropped, going from `sent` straight to `next` */
+static bool smtd_report_foldable(report_keyboard_t *sent, report_keyboard_t *held, report_keyboard_t *next) {
+    uint8_t held_mods = sent->mods ^ held->mods;
+    uint8_t next_mods = held->mods ^ next->mods;
+    if (held_mods & next_mods) {
+        return false;
+    }
+
+    bool held_keeps_keys = smtd_report_keys_within(held, sent) && smtd_report_keys_within(sent, held);
+    if (held_keeps_keys) {
+        return true;
+    }
+
+    bool held_releases_keys = !held_mods && smtd_report_keys_within(held, sent);
+    bool next_keeps_keys    = smtd_report_keys_within(next, held) && smtd_report_keys_within(held, next);
+    return held_releases_keys && next_keeps_keys;
+}
+
+/* ************************************* *
+ *             TYPING STREAK             *
+ * ************************************* */
+
+// A macro key pressed shortly after a letter was typed is taken as a tap right away, skipping the
+// state machine. How shortly is the SMTD_TIMEOUT_STREAK of the key, 0 turns the streak off for it,
+// and it counts from press to press. Letters are seen in the reports sent to the host, so taps
+// resolved by sm_td count as well, and a letter is stamped with the press of the key that typed it:
+// the event of a key passed on, or the press of a macro key for its tap. Any other key, or a
+// modifier other than shift, ends the streak.
+
+/** The press time of the last letter typed, with the lowest bit set, or 0 when there is no streak */
+static uint16_t smtd_streak_timer = 0;
+
+/** The press time of the key whose reports are being sent */
+static uint16_t smtd_streak_pressed_at = 0;
+
+/** The report the streak was last updated from */
+static report_keyboard_t smtd_streak_report;
+
+/** Macro keys tapped on press by the streak or a bigram roll, their release is swallowed. Indexed by SMTD_KEY_INDEX() */
+static uint8_t smtd_streak_keys[(SMTD_KEY_COUNT + 7) / 8] = {0};
+
+static void smtd_streak_observe(report_keyboard_t *report) {
+    if (report->mods & ~MOD_MASK_SHIFT) {
+        smtd_streak_timer = 0;
+    }
+
+    for (uint8_t i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+        uint8_t key = report->keys[i];
+        if (!key || smtd_report_has_key(&smtd_streak_report, key)) {
+            continue;
+        }
+        if (KC_A <= key && key <= KC_Z && !(report->mods & ~MOD_MASK_SHIFT)) {
+            smtd_streak_timer = smtd_streak_pressed_at | 1;
+        } else {
+            smtd_streak_timer = 0;
+        }
+    }
+
+    smtd_streak_report = *report;
+}
+
+static inline bool smtd_streak_active(uint16_t keycode) {
+    uint32_t timeout = get_smtd_timeout_or_default(keycode, SMTD_TIMEOUT_STREAK);
+    return smtd_streak_timer && timeout && (uint16_t)((uint16_t)smtd_timer_now - smtd_streak_timer) < timeout;
+}
+
+static inline void smtd_streak_mark(uint16_t keycode) {
+    uint8_t idx = SMTD_KEY_INDEX(keycode);
+    smtd_streak_keys[idx >> 3] |= 1 << (idx & 7);
+}
+
+static inline bool smtd_streak_swallow(uint16_t keycode) {
+    uint8_t idx = SMTD_KEY_INDEX(keycode);
+    uint8_t bit = 1 << (idx & 7);
+    if (!(smtd_streak_keys[idx >> 3] & bit)) {
+        return false;
+    }
+    smtd_streak_keys[idx >> 3] &= ~bit;
+    return true;
+}
+
+static void smtd_report_flush(void) {
+    if (smtd_report_has_held) {
+        smtd_report_has_held = false;
+        smtd_report_emit(&smtd_report_held, smtd_report_held_spaced);
+    }
+}
+
+static void smtd_output_send_keyboard(report_keyboard_t *report) {
+    bool spaced         = smtd_output_barrier;
+    smtd_output_barrier = false;
+
+    smtd_streak_observe(report);
+
+    if (!smtd_report_transaction || !SMTD_GLOBAL_COALESCE_REPORTS) {
+        smtd_report_emit(report, spaced);
+        return;
+    }
 
-bool smtd_feature_enabled_or_default(uint16_t keycode, smtd_feature feature) {
-    if (smtd_feature_enabled) {
-        return smtd_feature_enabled(keycode, feature);
+    // a barrier asks for the reports around it to reach the host separately
+    if (smtd_report_has_held && (spaced || !smtd_report_foldable(&smtd_report_sent, &smtd_report_held, report))) {
+        smtd_report_flush();
     }
-    return smtd_feature_enabled_default(feature);
+
+    smtd_report_held        = *report;
+    smtd_report_held_spaced = spaced || (smtd_report_has_held && smtd_report_held_spaced);
+    smtd_report_has_held    = true;
 }
 
-/* ************************************* *
- *       USER ACTION DEFINITIONS         *
- * ************************************* */
+void smtd_report_begin(void) {
+    smtd_report_transaction = true;
+    smtd_report_count       = 0;
+}
 
-typedef enum {
-    SMTD_ACTION_TOUCH,
-    SMTD_ACTION_TAP,
-    SMTD_ACTION_HOLD,
-    SMTD_ACTION_RELEASE,
-} smtd_action;
+void smtd_report_end(smtd_action action) {
+    smtd_report_flush();
+    smtd_report_transaction = false;
 
-#ifdef SMTD_DEBUG_ENABLED
-char *smtd_action_to_string(smtd_action action) {
-    switch (action) {
-        case SMTD_ACTION_TOUCH:
-            return "ACT_TOUCH";
-        case SMTD_ACTION_TAP:
-            return "ACT_TAP";
-        case SMTD_ACTION_HOLD:
-            return "ACT_HOLD";
-        case SMTD_ACTION_RELEASE:
-            return "ACT_RELEASE";
+    if (action == SMTD_ACTION_TAP) {
+        smtd_reports.taps++;
+        smtd_reports.tap_reports += smtd_report_count;
+    } else {
+        smtd_reports.holds++;
+        smtd_reports.hold_reports += smtd_report_count;
     }
-    return "ACT_UNKNOWN";
 }
-#endif
 
-void on_smtd_action(uint16_t keycode, smtd_action action, uint8_t sequence_len);
+void smtd_output_task(void) {
+    host_driver_t *driver = host_get_driver();
+    if (driver && driver != &smtd_output_driver) {
+        smtd_host_driver                 = driver;
+        smtd_output_driver               = *driver;
+        smtd_output_driver.send_keyboard = smtd_output_send_keyboard;
+        host_set_driver(&smtd_output_driver);
+    }
 
-#ifdef SMTD_DEBUG_ENABLED
-#    define SMTD_ACTION(action, state)                                                                                                          \
-        printf("%s by %s in %s\n", smtd_action_to_string(action), keycode_to_string(state->macro_keycode), smtd_stage_to_string(state->stage)); \
-        on_smtd_action(state->macro_keycode, action, state->sequence_len);
-#else
-#    define SMTD_ACTION(action, state) on_smtd_action(state->macro_keycode, action, state->sequence_len);
+#if SMTD_GLOBAL_SIMULTANEOUS_PRESSES_DELAY_MS > 0
+    while (smtd_output_len && smtd_output_ready(smtd_output_queue[smtd_output_head].spaced)) {
+        smtd_output_pop();
+    }
 #endif
+}
 
 /* ************************************* *
- *       USER STATES DEFINITIONS         *
+ *             REPLAY QUEUE              *
  * ************************************* */
 
-typedef enum {
-    SMTD_STAGE_NONE,
-    SMTD_STAGE_TOUCH,
-    SMTD_STAGE_SEQUENCE,
-    SMTD_STAGE_FOLLOWING_TOUCH,
-    SMTD_STAGE_HOLD,
-    SMTD_STAGE_RELEASE,
-} smtd_stage;
-
-#ifdef SMTD_DEBUG_ENABLED
-char *smtd_stage_to_string(smtd_stage stage) {
-    switch (stage) {
-        case SMTD_STAGE_NONE:
-            return "STAGE_NONE";
-        case SMTD_STAGE_TOUCH:
-            return "STAGE_TOUCH";
-        case SMTD_STAGE_SEQUENCE:
-            return "STAGE_SEQUENCE";
-        case SMTD_STAGE_FOLLOWING_TOUCH:
-            return "STAGE_FOL_TOUCH";
-        case SMTD_STAGE_HOLD:
-            return "STAGE_HOLD";
-        case SMTD_STAGE_RELEASE:
-            return "STAGE_RELEASE";
-    }
-    return "STAGE_UNKNOWN";
-}
+// Resolving a state often means replaying the keys pressed meanwhile, so that other states and
+// layers see them. Replayed events are queued instead of being fed to process_record() right away,
+// and the queue is drained by the outermost process_smtd() or smtd_task() call. So process_record()
+// nests at most once, however many states are interleaved.
+//
+// Operations queued while an operation is drained go right after it, ahead of the rest of the queue,
+// which keeps the order the nested process_record() calls used to have. A replayed event is not
+// offered to the states that replay it, nor to the ones that replayed the event being handled.
+
+#ifndef SMTD_REPLAY_QUEUE_SIZE
+#    define SMTD_REPLAY_QUEUE_SIZE 16
 #endif
 
+typedef enum {
+    SMTD_REPLAY_EVENT,
+    SMTD_REPLAY_SPACE,
+    SMTD_REPLAY_ACTION,
+    SMTD_REPLAY_STAGE,
+} smtd_replay_kind;
+
 typedef struct {
-    /** The keycode of the macro key */
-    uint16_t macro_keycode;
+    /** The kind of the operation, a smtd_replay_kind */
+    uint8_t kind;
 
-    /** The mods before the touch action performed. Required for mod_recall feature */
-    uint8_t modes_before_touch;
+    /** SMTD_REPLAY_EVENT: the key, its direction and the time stamp of the event */
+    keypos_t key;
+    bool     pressed;
+    uint16_t time;
 
-    /** Since touch can modify global mods, we need to save them separately to correctly restore a state before touch */
-    uint8_t modes_with_touch;
+    /** SMTD_REPLAY_EVENT: the slots that won't be offered the event */
+    uint16_t skip_slots;
 
-    /** The length of the sequence of same key taps */
-    uint8_t sequence_len;
+    /** SMTD_REPLAY_ACTION and SMTD_REPLAY_STAGE: the handle of the state, and the action or stage to go with */
+    uint16_t state;
+    uint8_t  value;
+} smtd_replay_op;
 
-    /** The position of key that was pressed after macro was pressed */
-    keypos_t following_key;
+static smtd_replay_op smtd_replay_queue[SMTD_REPLAY_QUEUE_SIZE];
+static uint8_t        smtd_replay_len = 0;
 
-    /** The keycode of the key that was pressed after macro was pressed */
-    uint16_t following_keycode;
+/** Where the next operation is inserted, also the number of operations queued by the current handler */
+static uint8_t smtd_replay_insert = 0;
 
-    /** The timeout of current stage */
-    deferred_token timeout;
+static bool smtd_replay_draining = false;
 
-    /** The current stage of the state */
-    smtd_stage stage;
+/** The deepest the queue has been */
+uint8_t smtd_replay_high_water = 0;
 
-    /** The flag that indicates that the state is frozen, so it won't handle any events */
-    bool freeze;
-} smtd_state;
+/** The number of operations dropped because the queue was full */
+uint16_t smtd_replay_overflows = 0;
 
-#define EMPTY_STATE {.macro_keycode = 0, .modes_before_touch = 0, .modes_with_touch = 0, .sequence_len = 0, .following_key = MAKE_KEYPOS(0, 0), .following_keycode = 0, .timeout = INVALID_DEFERRED_TOKEN, .stage = SMTD_STAGE_NONE, .freeze = false}
+static void smtd_replay_push(smtd_replay_op op) {
+    if (smtd_replay_len == SMTD_REPLAY_QUEUE_SIZE) {
+        smtd_replay_overflows++;
+#ifdef SMTD_DEBUG_ENABLED
+        printf("REPLAY QUEUE FULL, DROP OP %d\n", op.kind);
+#endif
+        return;
+    }
 
-/* ************************************* *
- *             LAYER UTILS               *
- * ************************************* */
+    memmove(&smtd_replay_queue[smtd_replay_insert + 1], &smtd_replay_queue[smtd_replay_insert], (smtd_replay_len - smtd_replay_insert) * sizeof(smtd_replay_op));
+    smtd_replay_queue[smtd_replay_insert++] = op;
+    smtd_replay_len++;
+    if (smtd_replay_len > smtd_replay_high_water) {
+        smtd_replay_high_water = smtd_replay_len;
+    }
+}
+
+static void smtd_replay_forget(uint8_t idx) {
+    for (uint8_t i = 0; i < smtd_replay_len; i++) {
+        smtd_replay_queue[i].skip_slots &= ~SMTD_SLOT_BIT(idx);
+    }
+}
+
+void smtd_replay_event(keypos_t key, bool pressed, uint16_t time, uint16_t skip_slots) {
+    smtd_replay_push((smtd_replay_op){.kind = SMTD_REPLAY_EVENT, .key = key, .pressed = pressed, .time = time, .skip_slots = smtd_replay_skip | skip_slots});
+}
 
-#define RETURN_LAYER_NOT_SET 15
+void smtd_replay_action(smtd_state *state, smtd_action action) {
+    smtd_replay_push((smtd_replay_op){.kind = SMTD_REPLAY_ACTION, .state = smtd_state_handle(state), .value = action});
+}
 
-static uint8_t return_layer     = RETURN_LAYER_NOT_SET;
-static uint8_t return_layer_cnt = 0;
+void smtd_replay_stage(smtd_state *state, smtd_stage stage) {
+    smtd_replay_push((smtd_replay_op){.kind = SMTD_REPLAY_STAGE, .state = smtd_state_handle(state), .value = stage});
+}
 
-void avoid_unused_variable_on_compile(void *ptr) {
-    // just touch them, so compiler won't throw "defined but not used" error
-    // that variables are used in macros that user may not use
-    if (return_layer == RETURN_LAYER_NOT_SET) return_layer = RETURN_LAYER_NOT_SET;
-    if (return_layer_cnt == 0) return_layer_cnt = 0;
+#if SMTD_GLOBAL_SIMULTANEOUS_PRESSES_DELAY_MS > 0
+void smtd_output_space(void) {
+    // the spacing goes before whatever comes next, which may be a queued operation
+    if (smtd_replay_insert > 0) {
+        smtd_replay_push((smtd_replay_op){.kind = SMTD_REPLAY_SPACE});
+    } else {
+        smtd_output_barrier = true;
+    }
 }
+#endif
 
-#define LAYER_PUSH(layer)                              \
-    return_layer_cnt++;                                \
-    if (return_layer == RETURN_LAYER_NOT_SET) {        \
-        return_layer = get_highest_layer(layer_state); \
-    }                                                  \
-    layer_move(layer);
+void smtd_next_stage(smtd_state *state, smtd_stage next_stage);
 
-#define LAYER_RESTORE()                          \
-    if (return_layer_cnt > 0) {                  \
-        return_layer_cnt--;                      \
-        if (return_layer_cnt == 0) {             \
-            layer_move(return_layer);            \
-            return_layer = RETURN_LAYER_NOT_SET; \
-        }                                        \
+void smtd_replay_drain(void) {
+    if (smtd_replay_draining) {
+        return;
     }
+    smtd_replay_draining = true;
+
+    while (smtd_replay_len) {
+        smtd_replay_op op = smtd_replay_queue[0];
+        smtd_replay_len--;
+        memmove(&smtd_replay_queue[0], &smtd_replay_queue[1], smtd_replay_len * sizeof(smtd_replay_op));
+        smtd_replay_insert = 0;
+
+        smtd_state *state;
+        switch (op.kind) {
+            case SMTD_REPLAY_EVENT: {
+                keyrecord_t record = {.event = MAKE_KEYEVENT(op.key.row, op.key.col, op.pressed)};
+                record.event.time  = op.time;
+                smtd_replay_skip   = op.skip_slots;
+                process_record(&record);
+                smtd_replay_skip = 0;
+                break;
+            }
 
-/* ************************************* *
- *      CORE LOGIC IMPLEMENTATION        *
- * ************************************* */
+            case SMTD_REPLAY_SPACE:
+                smtd_output_barrier = true;
+                break;
+
+            case SMTD_REPLAY_ACTION:
+                state = smtd_state_from_handle(op.state);
+                if (state) {
+                    SMTD_ACTION((smtd_action)op.value, state)
+                }
+                break;
+
+            case SMTD_REPLAY_STAGE:
+                state = smtd_state_from_handle(op.state);
+                if (state) {
+                    smtd_next_stage(state, (smtd_stage)op.value);
+                }
+                break;
+        }
+    }
+
+    smtd_replay_insert   = 0;
+    smtd_replay_draining = false;
+}
 
-smtd_state smtd_active_states[10]  = {EMPTY_STATE, EMPTY_STATE, EMPTY_STATE, EMPTY_STATE, EMPTY_STATE, EMPTY_STATE, EMPTY_STATE, EMPTY_STATE, EMPTY_STATE, EMPTY_STATE};
-uint8_t    smtd_active_states_size = 0;
+#ifdef SMTD_ADAPTIVE_TERMS
+#    define SMTD_RECORD_PRESS(state, tap, duration) smtd_adaptive_record(state->macro_keycode, tap, duration);
+#else
+#    define SMTD_RECORD_PRESS(state, tap, duration)
+#endif
 
 #define DO_ACTION_TAP(state)                                                                                                            \
+    smtd_streak_pressed_at = state->pressed_at;                                                                                         \
+    smtd_report_begin();                                                                                                                \
     uint8_t current_mods = get_mods();                                                                                                  \
-    if (smtd_feature_enabled_or_default(state->macro_keycode, SMTD_FEATURE_MODS_RECALL) && state->modes_before_touch != current_mods) { \
+    if (SMTD_HAS_FEATURE(state, SMTD_FEATURE_MODS_RECALL) && state->modes_before_touch != current_mods) {                               \
         set_mods(state->modes_before_touch);                                                                                            \
         send_keyboard_report();                                                                                                         \
                                                                                                                                         \
@@ -310,12 +1673,10 @@ uint8_t    smtd_active_states_size = 0;
         state->modes_with_touch   = 0;                                                                                                  \
     } else {                                                                                                                            \
         SMTD_ACTION(SMTD_ACTION_TAP, state)                                                                                             \
-    }
+    }                                                                                                                                   \
+    smtd_report_end(SMTD_ACTION_TAP);
 
 void smtd_press_following_key(smtd_state *state, bool release) {
-    state->freeze            = true;
-    keyevent_t  event_press  = MAKE_KEYEVENT(state->following_key.row, state->following_key.col, true);
-    keyrecord_t record_press = {.event = event_press};
 #ifdef SMTD_DEBUG_ENABLED
     if (release) {
         printf("FOLLOWING_TAP(%s) by %s in %s\n", keycode_to_string(state->following_keycode), keycode_to_string(state->macro_keycode), smtd_stage_to_string(state->stage));
@@ -323,61 +1684,45 @@ void smtd_press_following_key(smtd_state *state, bool release) {
         printf("FOLLOWING_PRESS(%s) by %s in %s\n", keycode_to_string(state->following_keycode), keycode_to_string(state->macro_keycode), smtd_stage_to_string(state->stage));
     }
 #endif
-    process_record(&record_press);
+    smtd_replay_event(state->following_key, true, state->following_at, SMTD_SLOT_BIT(smtd_slot_of(state)));
     if (release) {
-        keyevent_t  event_release  = MAKE_KEYEVENT(state->following_key.row, state->following_key.col, false);
-        keyrecord_t record_release = {.event = event_release};
+        // the release is only replayed while the release of the following key is handled
         SMTD_SIMULTANEOUS_PRESSES_DELAY
-        process_record(&record_release);
+        smtd_replay_event(state->following_key, false, smtd_timer_now, SMTD_SLOT_BIT(smtd_slot_of(state)));
     }
-    state->freeze = false;
 }
 
-void smtd_next_stage(smtd_state *state, smtd_stage next_stage);
-
-uint32_t timeout_reset_seq(uint32_t trigger_time, void *cb_arg) {
-    smtd_state *state   = (smtd_state *)cb_arg;
+void timeout_reset_seq(smtd_state *state) {
     state->sequence_len = 0;
-
-    return 0;
 }
 
-uint32_t timeout_touch(uint32_t trigger_time, void *cb_arg) {
-    smtd_state *state = (smtd_state *)cb_arg;
+void timeout_touch(smtd_state *state) {
     smtd_next_stage(state, SMTD_STAGE_HOLD);
-    return 0;
 }
 
-uint32_t timeout_sequence(uint32_t trigger_time, void *cb_arg) {
-    smtd_state *state = (smtd_state *)cb_arg;
-
-    if (smtd_feature_enabled_or_default(state->macro_keycode, SMTD_FEATURE_AGGREGATE_TAPS)) {
+void timeout_sequence(smtd_state *state) {
+    if (SMTD_HAS_FEATURE(state, SMTD_FEATURE_AGGREGATE_TAPS)) {
         DO_ACTION_TAP(state);
     }
 
     smtd_next_stage(state, SMTD_STAGE_NONE);
-    return 0;
 }
 
-uint32_t timeout_following_touch(uint32_t trigger_time, void *cb_arg) {
-    smtd_state *state = (smtd_state *)cb_arg;
+void timeout_following_touch(smtd_state *state) {
     smtd_next_stage(state, SMTD_STAGE_HOLD);
 
     SMTD_SIMULTANEOUS_PRESSES_DELAY
     smtd_press_following_key(state, false);
-    return 0;
 }
 
-uint32_t timeout_release(uint32_t trigger_time, void *cb_arg) {
-    smtd_state *state = (smtd_state *)cb_arg;
-
+void timeout_release(smtd_state *state) {
+    SMTD_RECORD_PRESS(state, true, state->press_duration)
     DO_ACTION_TAP(state);
 
     SMTD_SIMULTANEOUS_PRESSES_DELAY
     smtd_press_following_key(state, false);
 
     smtd_next_stage(state, SMTD_STAGE_NONE);
-    return 0;
 }
 
 void smtd_next_stage(smtd_state *state, smtd_stage next_stage) {
@@ -385,76 +1730,54 @@ void smtd_next_stage(smtd_state *state, smtd_stage next_stage) {
     printf("STAGE by %s, %s -> %s\n", keycode_to_string(state->macro_keycode), smtd_stage_to_string(state->stage), smtd_stage_to_string(next_stage));
 #endif
 
-    deferred_token prev_token = state->timeout;
-    state->timeout            = INVALID_DEFERRED_TOKEN;
-    state->stage              = next_stage;
+    SMTD_TRACE_RECORD(SMTD_TRACE_STAGE, state->macro_keycode, 0, state->stage << 4 | next_stage, 0)
+    smtd_timer_cancel(state);
+#ifdef SMTD_LATENCY_STATS
+    smtd_latency_stage(state);
+#endif
+    state->stage = next_stage;
 
     switch (state->stage) {
         case SMTD_STAGE_NONE:
-            for (uint8_t i = 0; i < smtd_active_states_size; i++) {
-                if (&smtd_active_states[i] != state) continue;
-
-                for (uint8_t j = i; j < smtd_active_states_size - 1; j++) {
-                    smtd_active_states[j].macro_keycode      = smtd_active_states[j + 1].macro_keycode;
-                    smtd_active_states[j].modes_before_touch = smtd_active_states[j + 1].modes_before_touch;
-                    smtd_active_states[j].modes_with_touch   = smtd_active_states[j + 1].modes_with_touch;
-                    smtd_active_states[j].sequence_len       = smtd_active_states[j + 1].sequence_len;
-                    smtd_active_states[j].following_key      = smtd_active_states[j + 1].following_key;
-                    smtd_active_states[j].following_keycode  = smtd_active_states[j + 1].following_keycode;
-                    smtd_active_states[j].timeout            = smtd_active_states[j + 1].timeout;
-                    smtd_active_states[j].stage              = smtd_active_states[j + 1].stage;
-                    smtd_active_states[j].freeze             = smtd_active_states[j + 1].freeze;
-                }
-
-                smtd_active_states_size--;
-                smtd_state *last_state         = &smtd_active_states[smtd_active_states_size];
-                last_state->macro_keycode      = 0;
-                last_state->modes_before_touch = 0;
-                last_state->modes_with_touch   = 0;
-                last_state->sequence_len       = 0;
-                last_state->following_key      = MAKE_KEYPOS(0, 0);
-                last_state->following_keycode  = 0;
-                last_state->timeout            = INVALID_DEFERRED_TOKEN;
-                last_state->stage              = SMTD_STAGE_NONE;
-                last_state->freeze             = false;
-
-                break;
-            }
+            // the slot goes back to the pool right away, other states are not touched
+            smtd_keycode_slots[SMTD_KEY_INDEX(state->macro_keycode)] = SMTD_NO_SLOT;
+            smtd_index_update(smtd_slot_of(state));
+            smtd_pool_free(state);
             break;
 
         case SMTD_STAGE_TOUCH:
+            state->pressed_at         = smtd_timer_now;
             state->modes_before_touch = get_mods();
             SMTD_ACTION(SMTD_ACTION_TOUCH, state)
             state->modes_with_touch = get_mods() & ~state->modes_before_touch;
-            state->timeout          = defer_exec(get_smtd_timeout_or_default(state->macro_keycode, SMTD_TIMEOUT_TAP), timeout_touch, state);
+            smtd_timer_arm(state, get_smtd_timeout_or_default(state->macro_keycode, SMTD_TIMEOUT_TAP));
             break;
 
         case SMTD_STAGE_SEQUENCE:
-            state->timeout = defer_exec(get_smtd_timeout_or_default(state->macro_keycode, SMTD_TIMEOUT_SEQUENCE), timeout_sequence, state);
+            smtd_timer_arm(state, get_smtd_timeout_or_default(state->macro_keycode, SMTD_TIMEOUT_SEQUENCE));
             break;
 
         case SMTD_STAGE_HOLD:
+            smtd_report_begin();
             SMTD_ACTION(SMTD_ACTION_HOLD, state)
+            smtd_report_end(SMTD_ACTION_HOLD);
             break;
 
         case SMTD_STAGE_FOLLOWING_TOUCH:
-            state->timeout = defer_exec(get_smtd_timeout_or_default(state->macro_keycode, SMTD_TIMEOUT_FOLLOWING_TAP), timeout_following_touch, state);
+            smtd_timer_arm(state, get_smtd_timeout_or_default(state->macro_keycode, SMTD_TIMEOUT_FOLLOWING_TAP));
             break;
 
         case SMTD_STAGE_RELEASE:
-            state->timeout = defer_exec(get_smtd_timeout_or_default(state->macro_keycode, SMTD_TIMEOUT_RELEASE), timeout_release, state);
+            smtd_timer_arm(state, get_smtd_timeout_or_default(state->macro_keycode, SMTD_TIMEOUT_RELEASE));
             break;
     }
 
-    // need to cancel after creating new timeout. There is a bug in QMK scheduling
-    cancel_deferred_exec(prev_token);
+    if (next_stage != SMTD_STAGE_NONE) {
+        smtd_index_update(smtd_slot_of(state));
+    }
 }
 
 bool process_smtd_state(uint16_t keycode, keyrecord_t *record, smtd_state *state) {
-    if (state->freeze) {
-        return true;
-    }
-
     switch (state->stage) {
         case SMTD_STAGE_NONE:
             if (keycode == state->macro_keycode && record->event.pressed) {
@@ -465,17 +1788,30 @@ bool process_smtd_state(uint16_t keycode, keyrecord_t *record, smtd_state *state
 
         case SMTD_STAGE_TOUCH:
             if (keycode == state->macro_keycode && !record->event.pressed) {
+                SMTD_RECORD_PRESS(state, true, smtd_held_for(state))
                 smtd_next_stage(state, SMTD_STAGE_SEQUENCE);
 
-                if (!smtd_feature_enabled_or_default(state->macro_keycode, SMTD_FEATURE_AGGREGATE_TAPS)) {
+                if (!SMTD_HAS_FEATURE(state, SMTD_FEATURE_AGGREGATE_TAPS)) {
                     DO_ACTION_TAP(state);
                 }
 
                 return false;
             }
+            if (keycode != state->macro_keycode && record->event.pressed && smtd_bigram_roll(state->macro_keycode, keycode)) {
+                // a common roll, so the macro key is a tap and its release is swallowed later
+                DO_ACTION_TAP(state);
+                smtd_streak_mark(state->macro_keycode);
+                smtd_next_stage(state, SMTD_STAGE_NONE);
+
+                // the state is already released, so it doesn't need to be skipped
+                SMTD_SIMULTANEOUS_PRESSES_DELAY
+                smtd_replay_event(record->event.key, true, record->event.time, 0);
+                return false;
+            }
             if (keycode != state->macro_keycode && record->event.pressed) {
                 state->following_key     = record->event.key;
                 state->following_keycode = keycode;
+                state->following_at      = record->event.time;
                 smtd_next_stage(state, SMTD_STAGE_FOLLOWING_TOUCH);
                 return false;
             }
@@ -488,7 +1824,7 @@ bool process_smtd_state(uint16_t keycode, keyrecord_t *record, smtd_state *state
                 return false;
             }
             if (record->event.pressed) {
-                if (smtd_feature_enabled_or_default(state->macro_keycode, SMTD_FEATURE_AGGREGATE_TAPS)) {
+                if (SMTD_HAS_FEATURE(state, SMTD_FEATURE_AGGREGATE_TAPS)) {
                     DO_ACTION_TAP(state);
                 }
 
@@ -504,6 +1840,7 @@ bool process_smtd_state(uint16_t keycode, keyrecord_t *record, smtd_state *state
 
             if (keycode == state->macro_keycode && !record->event.pressed) {
                 // Macro key is released, moving to the next stage
+                state->press_duration = smtd_held_for(state);
                 smtd_next_stage(state, SMTD_STAGE_RELEASE);
                 return false;
             }
@@ -535,11 +1872,7 @@ bool process_smtd_state(uint16_t keycode, keyrecord_t *record, smtd_state *state
                 // because by holding first two keys we might have changed a layer, so current keycode might be not actual
                 // if we don't do this, we might continue processing the wrong key
                 SMTD_SIMULTANEOUS_PRESSES_DELAY
-                state->freeze            = true;
-                keyevent_t  event_press  = MAKE_KEYEVENT(record->event.key.row, record->event.key.col, true);
-                keyrecord_t record_press = {.event = event_press};
-                process_record(&record_press);
-                state->freeze = false;
+                smtd_replay_event(record->event.key, true, record->event.time, SMTD_SLOT_BIT(smtd_slot_of(state)));
 
                 // we have processed the 3rd key, so we intentionally return false to stop further processing
                 return false;
@@ -548,6 +1881,7 @@ bool process_smtd_state(uint16_t keycode, keyrecord_t *record, smtd_state *state
 
         case SMTD_STAGE_HOLD:
             if (keycode == state->macro_keycode && !record->event.pressed) {
+                SMTD_RECORD_PRESS(state, false, smtd_held_for(state))
                 SMTD_ACTION(SMTD_ACTION_RELEASE, state)
 
                 smtd_next_stage(state, SMTD_STAGE_NONE);
@@ -560,16 +1894,17 @@ bool process_smtd_state(uint16_t keycode, keyrecord_t *record, smtd_state *state
             // At this stage we have just released the macro key and still holding the following key
 
             if (keycode == state->macro_keycode && record->event.pressed) {
+                SMTD_RECORD_PRESS(state, true, state->press_duration)
                 DO_ACTION_TAP(state);
 
                 SMTD_SIMULTANEOUS_PRESSES_DELAY
                 smtd_press_following_key(state, false);
 
                 // todo need to go to NONE stage and from NONE jump to TOUCH stage
-                SMTD_SIMULTANEOUS_PRESSES_DELAY
-                smtd_next_stage(state, SMTD_STAGE_TOUCH);
-
+                // the touch comes after the following key, so it is queued as well
                 state->sequence_len = 0;
+                SMTD_SIMULTANEOUS_PRESSES_DELAY
+                smtd_replay_stage(state, SMTD_STAGE_TOUCH);
 
                 return false;
             }
@@ -578,15 +1913,18 @@ bool process_smtd_state(uint16_t keycode, keyrecord_t *record, smtd_state *state
                 // we need to execute hold the macro key and execute tap the following key
                 // then close the state
 
+                SMTD_RECORD_PRESS(state, false, state->press_duration)
+                smtd_report_begin();
                 SMTD_ACTION(SMTD_ACTION_HOLD, state)
+                smtd_report_end(SMTD_ACTION_HOLD);
 
                 SMTD_SIMULTANEOUS_PRESSES_DELAY
                 smtd_press_following_key(state, true);
 
+                // the release comes after the following key tap, so it is queued as well
                 SMTD_SIMULTANEOUS_PRESSES_DELAY
-                SMTD_ACTION(SMTD_ACTION_RELEASE, state)
-
-                smtd_next_stage(state, SMTD_STAGE_NONE);
+                smtd_replay_action(state, SMTD_ACTION_RELEASE);
+                smtd_replay_stage(state, SMTD_STAGE_NONE);
 
                 return false;
             }
@@ -596,6 +1934,7 @@ bool process_smtd_state(uint16_t keycode, keyrecord_t *record, smtd_state *state
                 // we assume this to be tap macro key, press (w/o release) following key and press (w/o release) the 3rd key
 
                 // so we need to tap the macro key first
+                SMTD_RECORD_PRESS(state, true, state->press_duration)
                 DO_ACTION_TAP(state)
 
                 // then press and hold (without releasing) the following key
@@ -611,10 +1950,8 @@ bool process_smtd_state(uint16_t keycode, keyrecord_t *record, smtd_state *state
                 // if we don't do this, we might continue processing the wrong key
                 SMTD_SIMULTANEOUS_PRESSES_DELAY
 
-                // we also don't need to freeze the state here, because we are already put in NONE stage
-                keyevent_t  event_press  = MAKE_KEYEVENT(record->event.key.row, record->event.key.col, true);
-                keyrecord_t record_press = {.event = event_press};
-                process_record(&record_press);
+                // the state is already released, so it doesn't need to be skipped
+                smtd_replay_event(record->event.key, true, record->event.time, 0);
 
                 // we have processed the 3rd key, so we intentionally return false to stop further processing
                 return false;
@@ -629,13 +1966,21 @@ bool process_smtd_state(uint16_t keycode, keyrecord_t *record, smtd_state *state
  *      ENTRY POINT IMPLEMENTATION       *
  * ************************************* */
 
-bool process_smtd(uint16_t keycode, keyrecord_t *record) {
+bool process_smtd_event(uint16_t keycode, keyrecord_t *record) {
 #ifdef SMTD_DEBUG_ENABLED
     printf("\n>> GOT KEY %s %s\n", keycode_to_string(keycode), record->event.pressed ? "PRESSED" : "RELEASED");
 #endif
+    SMTD_TRACE_RECORD(SMTD_TRACE_EVENT, keycode, record->event.pressed | smtd_replay_draining << 1, 0, record->event.key.row << 4 | record->event.key.col)
 
     // check if any active state may process an event
-    for (uint8_t i = 0; i < smtd_active_states_size; i++) {
+    // the candidates are looked up again after every state, since handling an event may start or finish states
+    for (uint8_t i = 0; i < SMTD_POOL_SIZE; i++) {
+        uint16_t slots = smtd_event_slots(keycode, record, i);
+        if (!slots) {
+            break;
+        }
+        i += __builtin_ctz(slots);
+
         smtd_state *state = &smtd_active_states[i];
         if (!process_smtd_state(keycode, record, state)) {
 #ifdef SMTD_DEBUG_ENABLED
@@ -647,6 +1992,12 @@ bool process_smtd(uint16_t keycode, keyrecord_t *record) {
 
     // may be start a new state? A key must be just pressed
     if (!record->event.pressed) {
+        if (smtd_is_macro_key(keycode) && smtd_streak_swallow(keycode)) {
+#ifdef SMTD_DEBUG_ENABLED
+            printf("<< STREAK RELEASE KEY %s\n", keycode_to_string(keycode));
+#endif
+            return false;
+        }
 #ifdef SMTD_DEBUG_ENABLED
         printf("<< BYPASS KEY %s %s\n", keycode_to_string(keycode), record->event.pressed ? "PRESSED" : "RELEASED");
 #endif
@@ -654,7 +2005,7 @@ bool process_smtd(uint16_t keycode, keyrecord_t *record) {
     }
 
     // check if the key is a macro key
-    if (keycode <= SMTD_KEYCODES_BEGIN || SMTD_KEYCODES_END <= keycode) {
+    if (!smtd_is_macro_key(keycode)) {
 #ifdef SMTD_DEBUG_ENABLED
         printf("<< BYPASS KEY %s %s\n", keycode_to_string(keycode), record->event.pressed ? "PRESSED" : "RELEASED");
 #endif
@@ -662,19 +2013,39 @@ bool process_smtd(uint16_t keycode, keyrecord_t *record) {
     }
 
     // check if the key is already handled
-    for (uint8_t i = 0; i < smtd_active_states_size; i++) {
-        if (smtd_active_states[i].macro_keycode == keycode) {
+    if (smtd_keycode_slot(keycode) != SMTD_NO_SLOT) {
 #ifdef SMTD_DEBUG_ENABLED
-            printf("<< ALREADY HANDELED KEY %s %s\n", keycode_to_string(keycode), record->event.pressed ? "PRESSED" : "RELEASED");
+        printf("<< ALREADY HANDELED KEY %s %s\n", keycode_to_string(keycode), record->event.pressed ? "PRESSED" : "RELEASED");
 #endif
-            return true;
-        }
+        return true;
+    }
+
+    // typing fast, so the key is a tap and there is no need to track it
+    if (smtd_streak_active(keycode)) {
+#ifdef SMTD_DEBUG_ENABLED
+        printf("<< STREAK TAP KEY %s\n", keycode_to_string(keycode));
+#endif
+        smtd_streak_mark(keycode);
+#ifdef SMTD_LATENCY_STATS
+        smtd_latency_action(keycode, SMTD_ACTION_TAP, 0);
+#endif
+        smtd_report_begin();
+        smtd_execute_action(keycode, SMTD_ACTION_TAP, 0);
+        smtd_report_end(SMTD_ACTION_TAP);
+        return false;
     }
 
     // create a new state and process the event
-    smtd_state *state    = &smtd_active_states[smtd_active_states_size];
-    state->macro_keycode = keycode;
-    smtd_active_states_size++;
+    smtd_state *state = smtd_pool_alloc();
+    if (!state) {
+#ifdef SMTD_DEBUG_ENABLED
+        printf("<< POOL FULL, BYPASS KEY %s %s\n", keycode_to_string(keycode), record->event.pressed ? "PRESSED" : "RELEASED");
+#endif
+        return true;
+    }
+    state->macro_keycode                        = keycode;
+    state->features                             = smtd_features_of(keycode);
+    smtd_keycode_slots[SMTD_KEY_INDEX(keycode)] = smtd_slot_of(state);
 
 #ifdef SMTD_DEBUG_ENABLED
     printf("<< CREATE STATE %s %s\n", keycode_to_string(keycode), record->event.pressed ? "PRESSED" : "RELEASED");
@@ -682,6 +2053,119 @@ bool process_smtd(uint16_t keycode, keyrecord_t *record) {
     return process_smtd_state(keycode, record, state);
 }
 
+void smtd_timeout_fire(smtd_state *state, bool late) {
+    // only traced
+    (void)late;
+    SMTD_TRACE_RECORD(SMTD_TRACE_TIMEOUT, state->macro_keycode, late, state->stage, 0)
+    switch (state->stage) {
+        case SMTD_STAGE_TOUCH:
+            timeout_touch(state);
+            break;
+        case SMTD_STAGE_SEQUENCE:
+            timeout_sequence(state);
+            break;
+        case SMTD_STAGE_FOLLOWING_TOUCH:
+            timeout_following_touch(state);
+            break;
+        case SMTD_STAGE_RELEASE:
+            timeout_release(state);
+            break;
+        case SMTD_STAGE_NONE:
+        case SMTD_STAGE_HOLD:
+            break;
+    }
+}
+
+/**
+ * Fires the stage timeouts due at now in deadline order, each at the time of its deadline. Only the
+ * timeouts pending on entry are fired, the ones armed by their handlers wait for the next call.
+ * Returns the number of timeouts fired.
+ */
+static uint8_t smtd_timers_fire(uint32_t now, bool late) {
+    if (!smtd_timer_slots || !timer_expired32(now, smtd_timer_next)) {
+        return 0;
+    }
+
+    uint16_t due = 0;
+    for (uint16_t slots = smtd_timer_slots; slots; slots &= slots - 1) {
+        uint8_t idx = __builtin_ctz(slots);
+        if (timer_expired32(now, smtd_active_states[idx].deadline)) {
+            due |= SMTD_SLOT_BIT(idx);
+        }
+    }
+
+    uint8_t fired = 0;
+    while (due) {
+        // fire in deadline order, a late scan may find several timeouts due at once
+        uint8_t first = __builtin_ctz(due);
+        for (uint16_t slots = due & (due - 1); slots; slots &= slots - 1) {
+            uint8_t idx = __builtin_ctz(slots);
+            if (timer_expired32(smtd_active_states[first].deadline, smtd_active_states[idx].deadline)) {
+                first = idx;
+            }
+        }
+        due &= ~SMTD_SLOT_BIT(first);
+
+        // a previous handler may have cancelled this timeout or reused the slot
+        smtd_state *state = &smtd_active_states[first];
+        if (!(smtd_timer_slots & SMTD_SLOT_BIT(first)) || !timer_expired32(now, state->deadline)) {
+            continue;
+        }
+        smtd_timer_cancel(state);
+        smtd_timer_now = state->deadline;
+        smtd_timeout_fire(state, late);
+        smtd_replay_drain();
+        fired++;
+    }
+
+    for (uint16_t slots = smtd_timer_slots; slots; slots &= slots - 1) {
+        uint32_t deadline = smtd_active_states[__builtin_ctz(slots)].deadline;
+        if (slots == smtd_timer_slots || timer_expired32(smtd_timer_next, deadline)) {
+            smtd_timer_next = deadline;
+        }
+    }
+    return fired;
+}
+
+bool process_smtd(uint16_t keycode, keyrecord_t *record) {
+    // replayed events are handled at the time of whatever replays them
+    if (!smtd_replay_draining) {
+        uint32_t      time   = smtd_event_time(record);
+        layer_state_t layers = layer_state;
+
+        // the event came after timeouts that smtd_task() has not fired yet, so they go first
+        uint8_t late = smtd_timers_fire(time, true);
+        smtd_late_resolutions += late;
+        smtd_timer_now = time;
+
+        if (late && layer_state != layers) {
+            // QMK looked the keycode up on the layers before the timeouts, so the event is looked up again
+            smtd_replay_event(record->event.key, record->event.pressed, record->event.time, 0);
+            smtd_replay_drain();
+            return false;
+        }
+    }
+
+    if (record->event.pressed) {
+        smtd_streak_pressed_at = record->event.time;
+    }
+    bool result = process_smtd_event(smtd_position_keycode(keycode, record), record);
+
+    // every path that queues a replay has consumed the event, so replaying right away keeps the order
+    smtd_replay_drain();
+    return result;
+}
+
+/** Fires due stage timeouts, must be called once per scan, e.g. from housekeeping_task_user() */
+void smtd_task(void) {
+    smtd_output_task();
+#ifdef SMTD_ADAPTIVE_TERMS
+    smtd_adaptive_task();
+#endif
+
+    smtd_timers_fire(timer_read32(), false);
+}
+
 /* ************************************* *
  *         CUSTOMIZATION MACROS          *
  * ************************************* */
@@ -774,17 +2258,99 @@ bool process_smtd(uint16_t keycode, keyrecord_t *record) {
                 break;                                         \
             case SMTD_ACTION_HOLD:                             \
                 if (tap_count < threshold) {                   \
-                    LAYER_PUSH(layer);                         \
+                    smtd_layer_push(macro_key, layer);         \
                 } else {                                       \
                     SMTD_REGISTER_16(use_cl, tap_key);         \
                 }                                              \
                 break;                                         \
             case SMTD_ACTION_RELEASE:                          \
                 if (tap_count < threshold) {                   \
-                    LAYER_RESTORE();                           \
+                    smtd_layer_pop(macro_key);                 \
                 }                                              \
                 SMTD_UNREGISTER_16(use_cl, tap_key);           \
                 break;                                         \
         }                                                      \
         break;                                                 \
     }
+
+/* ************************************* *
+ *          ACTION DESCRIPTORS           *
+ * ************************************* */
+
+static void smtd_run_descriptor(uint16_t keycode, smtd_action_descriptor *desc, smtd_action action, uint8_t tap_count) {
+    // past the threshold, a hold repeats the tap key instead of holding the mod or layer
+    bool    repeat = !(tap_count < desc->threshold);
+    uint8_t mod    = MOD_BIT(desc->mod_or_layer);
+
+    switch (action) {
+        case SMTD_ACTION_TOUCH:
+            if (desc->kind == SMTD_KIND_MTE) {
+                register_mods(mod);
+            }
+            break;
+
+        case SMTD_ACTION_TAP:
+            if (desc->kind == SMTD_KIND_MTE) {
+                unregister_mods(mod);
+            }
+            SMTD_TAP_16(desc->use_cl, desc->tap_key);
+            break;
+
+        case SMTD_ACTION_HOLD:
+            if (repeat) {
+                if (desc->kind == SMTD_KIND_MTE) {
+                    unregister_mods(mod);
+                }
+                SMTD_REGISTER_16(desc->use_cl, desc->tap_key);
+            } else if (desc->kind == SMTD_KIND_MT) {
+                register_mods(mod);
+            } else if (desc->kind == SMTD_KIND_LT) {
+                smtd_layer_push(keycode, desc->mod_or_layer);
+            }
+            break;
+
+        case SMTD_ACTION_RELEASE:
+            if (desc->kind == SMTD_KIND_LT) {
+                if (!repeat) {
+                    smtd_layer_pop(keycode);
+                }
+                SMTD_UNREGISTER_16(desc->use_cl, desc->tap_key);
+            } else if (!repeat) {
+                unregister_mods(mod);
+                if (desc->kind == SMTD_KIND_MTE) {
+                    send_keyboard_report();
+                }
+            } else {
+                SMTD_UNREGISTER_16(desc->use_cl, desc->tap_key);
+                if (desc->kind == SMTD_KIND_MT) {
+                    send_keyboard_report();
+                }
+            }
+            break;
+    }
+}
+
+void smtd_execute_action(uint16_t keycode, smtd_action action, uint8_t sequence_len) {
+#ifdef SMTD_POSITIONS
+    if (SMTD_POSITION_KEYCODES_BEGIN <= keycode && keycode <= QK_USER_MAX) {
+        smtd_action_descriptor desc;
+        memcpy_P(&desc, &smtd_position_actions[keycode - SMTD_POSITION_KEYCODES_BEGIN], sizeof(desc));
+        desc.tap_key = smtd_position_tap_key(keycode);
+        smtd_run_descriptor(keycode, &desc, action, sequence_len);
+        return;
+    }
+#endif
+#ifdef SMTD_ACTIONS
+    if (SMTD_KEYCODES_BEGIN < keycode && keycode < SMTD_KEYCODES_END) {
+        smtd_action_descriptor desc;
+        memcpy_P(&desc, &smtd_action_descriptors[keycode - SMTD_KEYCODES_BEGIN - 1], sizeof(desc));
+        if (desc.kind != SMTD_KIND_NONE) {
+            smtd_run_descriptor(keycode, &desc, action, sequence_len);
+            return;
+        }
+    }
+#endif
+    if (on_smtd_action) {
+        on_smtd_action(keycode, action, sequence_len);
+    }
+}
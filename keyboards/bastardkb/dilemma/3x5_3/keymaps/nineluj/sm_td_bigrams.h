@@ -0,0 +1,5 @@
+// Generated by sm_td_bigrams.py --min-samples 20 --min-roll-share 95, do not edit
+// 0 overlapping presses read, rolls are listed most common first
+#pragma once
+
+#define SMTD_BIGRAM_ROLLS(X)
@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""Generates sm_td_bigrams.h, the rolls sm_td resolves as a tap on the second press.
+
+A roll is a same-hand pair that starts on a home row mod and, in the typing logs, is nearly always
+typed as a roll: the second key is pressed while the mod is still down, and the mod is released
+first. When the second key is released first, the pair was typed as a chord, a mod and a key.
+Pairs that are mostly chords, or seen too rarely to tell, are left out, and so are the common
+shortcuts of Ctrl, GUI and Alt, so that a held mod and a same-hand letter stay a chord.
+
+A log has one key event per line, "TIME KEY +" for a press and "TIME KEY -" for a release, the
+time in milliseconds and the key as the character it types, or "space". Other lines are skipped.
+
+Usage: sm_td_bigrams.py [--min-samples N] [--min-roll-share PERCENT] LOG... > sm_td_bigrams.h
+"""
+
+import argparse
+import collections
+import sys
+
+# The letters of the base layer, each row as it is typed from the left
+LEFT = ["qwfpb", "arstg", "zxcdv"]
+RIGHT = ["jluy", "mneio", "kh"]
+
+# The letters sent by sm_td macro keys, every other letter is a plain KC_ keycode
+MACRO_KEYS = {"a": "CKC_A", "r": "CKC_R", "s": "CKC_S", "t": "CKC_T", "n": "CKC_N", "e": "CKC_E", "i": "CKC_I", "o": "CKC_O"}
+
+# The mod of every home row mod, as in SMTD_ACTIONS of keymap.c, layer keys keep waiting for the
+# following key
+MOD_KEYS = {"a": "alt", "r": "gui", "s": "ctrl", "t": "shift", "n": "shift", "e": "ctrl", "i": "gui", "o": "alt"}
+
+# Letters of common shortcuts, never rolls after a Ctrl, GUI or Alt home row mod
+SHORTCUT_LETTERS = "acefilnoqrstvwxz"
+
+
+def keycode(letter):
+    return MACRO_KEYS.get(letter, "KC_" + letter.upper())
+
+
+def hand(letter):
+    return "left" if any(letter in row for row in LEFT) else "right"
+
+
+def read_events(path):
+    """Yields the (time, key, pressed) events of a log"""
+    with open(path, encoding="utf-8", errors="ignore") as log:
+        for line in log:
+            fields = line.split()
+            if len(fields) != 3 or not fields[0].isdigit() or fields[2] not in "+-":
+                continue
+            yield int(fields[0]), fields[1].lower(), fields[2] == "+"
+
+
+def count_overlaps(events, rolls, chords):
+    """Counts the pairs typed while a home row mod is down, as rolls or as chords"""
+    down = {}  # key -> whether another key was pressed while it was down
+    pending = []  # overlapping (first, second) pairs, neither released yet
+    for _, key, pressed in events:
+        if pressed:
+            for first, followed in down.items():
+                if not followed and first in MOD_KEYS and first != key:
+                    down[first] = True
+                    pending.append((first, key))
+            down[key] = False
+            continue
+        down.pop(key, None)
+        for pair in list(pending):
+            if pair[1] == key:
+                # the second key is released first, a chord
+                chords[pair] += 1
+                pending.remove(pair)
+            elif pair[0] == key:
+                # the mod is released first, a roll
+                rolls[pair] += 1
+                pending.remove(pair)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--min-samples", type=int, default=20, help="overlapping presses a pair must be seen in")
+    parser.add_argument("--min-roll-share", type=float, default=95, help="share of those a roll must be typed as a roll, in percent")
+    parser.add_argument("log", nargs="*")
+    args = parser.parse_args()
+
+    rolls = collections.Counter()
+    chords = collections.Counter()
+    for path in args.log:
+        count_overlaps(read_events(path), rolls, chords)
+
+    table = collections.defaultdict(list)
+    for (first, second), count in rolls.most_common():
+        if not ("a" <= second <= "z") or hand(first) != hand(second):
+            continue
+        if MOD_KEYS[first] != "shift" and second in SHORTCUT_LETTERS:
+            continue
+        total = count + chords[first, second]
+        if total < args.min_samples or 100 * count < args.min_roll_share * total:
+            continue
+        table[first].append(second)
+
+    out = sys.stdout
+    out.write("// Generated by sm_td_bigrams.py --min-samples %d --min-roll-share %g, do not edit\n" % (args.min_samples, args.min_roll_share))
+    out.write("// %d overlapping presses read, rolls are listed most common first\n" % (sum(rolls.values()) + sum(chords.values())))
+    out.write("#pragma once\n\n")
+    entries = ["#define SMTD_BIGRAM_ROLLS(X)"]
+    for first in MOD_KEYS:
+        if table[first]:
+            bits = " | ".join("SMTD_BIGRAM_BIT(%s)" % keycode(second) for second in table[first])
+            entries.append("    X(%s, %s)" % (keycode(first), bits))
+    width = max(len(entry) for entry in entries) + 1
+    for i, entry in enumerate(entries):
+        out.write(entry + (" " * (width - len(entry)) + "\\" if i < len(entries) - 1 else "") + "\n")
+
+
+if __name__ == "__main__":
+    main()
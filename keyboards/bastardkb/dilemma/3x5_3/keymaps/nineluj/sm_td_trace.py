@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Decodes the sm_td trace that smtd_trace_dump() prints to the console.
+
+Reads a console log, e.g. saved from `qmk console`, finds the last dump in it and prints one line
+per record with the time since the first record. Stage, action and record type names are read from
+sm_td.h, custom keycode and position key names from keymap.c, so the decoder follows both files as
+they change.
+
+Usage: sm_td_trace.py [--keymap-dir DIR] [LOG]
+"""
+
+import argparse
+import os
+import re
+import sys
+
+# HID usages of the plain keycodes worth naming, everything else is printed as a number
+BASIC_KEYCODES = {0x28: "KC_ENT", 0x29: "KC_ESC", 0x2A: "KC_BSPC", 0x2B: "KC_TAB", 0x2C: "KC_SPC"}
+BASIC_KEYCODES.update({0x04 + i: "KC_" + chr(ord("A") + i) for i in range(26)})
+BASIC_KEYCODES.update({0x1E + i: "KC_%d" % ((i + 1) % 10) for i in range(10)})
+
+MODS = ["LCTL", "LSFT", "LALT", "LGUI", "RCTL", "RSFT", "RALT", "RGUI"]
+
+# Position keys take the keycodes at the top of the user range, see SMTD_POSITION_KEYCODES_BEGIN
+QK_USER_MAX = 0x7FFF
+
+
+def enum_names(source, name):
+    """Returns the member names of the C enum declared as `typedef enum {...} name;` or `enum name {...};`"""
+    match = re.search(r"typedef enum \{([^{}]*)\} %s;" % name, source) or re.search(r"enum %s \{([^{}]*)\};" % name, source)
+    if not match:
+        sys.exit("enum %s not found" % name)
+    body = re.sub(r"/\*.*?\*/|//[^\n]*", "", match.group(1), flags=re.S)
+    return [member.split("=")[0].strip() for member in body.split(",") if member.strip()]
+
+
+def position_names(source):
+    """Returns the entry names of the SMTD_POSITIONS table, empty without one"""
+    match = re.search(r"#define SMTD_POSITIONS\(X\)((?:[^\n]*\\\n)*[^\n]*)", source)
+    return re.findall(r"\bX\(\s*(\w+)", match.group(1)) if match else []
+
+
+def load_names(keymap_dir):
+    with open(os.path.join(keymap_dir, "sm_td.h")) as header:
+        sm_td = header.read()
+    with open(os.path.join(keymap_dir, "keymap.c")) as keymap:
+        source = keymap.read()
+        custom = enum_names(source, "custom_keycodes")
+        positions = position_names(source)
+    return {
+        "types": [name[len("SMTD_TRACE_"):] for name in enum_names(sm_td, "smtd_trace_type")],
+        "stages": [name[len("SMTD_STAGE_"):] for name in enum_names(sm_td, "smtd_stage")],
+        "actions": [name[len("SMTD_ACTION_"):] for name in enum_names(sm_td, "smtd_action")],
+        "custom": custom,
+        "positions": positions,
+    }
+
+
+def lookup(names, index):
+    return names[index] if index < len(names) else "?%d" % index
+
+
+def keycode_name(names, begin, keycode):
+    # the custom enum starts at SMTD_KEYCODES_BEGIN, whose value the dump header carries
+    if begin <= keycode < begin + len(names["custom"]):
+        return names["custom"][keycode - begin]
+    positions_begin = QK_USER_MAX + 1 - len(names["positions"])
+    if positions_begin <= keycode <= QK_USER_MAX:
+        return names["positions"][keycode - positions_begin]
+    return BASIC_KEYCODES.get(keycode, "0x%04X" % keycode)
+
+
+def mods_name(mods):
+    return "+".join(name for bit, name in enumerate(MODS) if mods & (1 << bit)) or "-"
+
+
+def describe(names, begin, type_name, keycode, arg, stages, key):
+    if type_name == "EVENT":
+        return "%-8s %s at %d,%d%s" % (
+            keycode_name(names, begin, keycode),
+            "press" if arg & 1 else "release",
+            key >> 4,
+            key & 0xF,
+            " (replayed)" if arg & 2 else "",
+        )
+    if type_name == "STAGE":
+        return "%-8s %s -> %s" % (keycode_name(names, begin, keycode), lookup(names["stages"], stages >> 4), lookup(names["stages"], stages & 0xF))
+    if type_name == "ACTION":
+        return "%-8s %s in %s" % (keycode_name(names, begin, keycode), lookup(names["actions"], arg), lookup(names["stages"], stages))
+    if type_name == "TIMEOUT":
+        return "%-8s in %s%s" % (keycode_name(names, begin, keycode), lookup(names["stages"], stages), " (late)" if arg & 1 else "")
+    if type_name == "REPORT":
+        keys = [keycode_name(names, begin, code) for code in (keycode & 0xFF, keycode >> 8) if code]
+        return "mods %s keys %s" % (mods_name(arg), " ".join(keys) or "-")
+    return "keycode 0x%04X arg %02X stages %02X key %02X" % (keycode, arg, stages, key)
+
+
+def last_dump(lines):
+    """Returns the header fields and the records of the last complete dump in the log"""
+    dump = None
+    current = None
+    for line in lines:
+        fields = line.split()
+        if "smtd-trace" not in fields:
+            continue
+        fields = fields[fields.index("smtd-trace") + 1 :]
+        if fields[:1] == ["begin"]:
+            current = (int(fields[1], 16), int(fields[2]), [])
+        elif fields[:1] == ["end"]:
+            if current is not None:
+                dump = current
+            current = None
+        elif current is not None and len(fields) == 6:
+            current[2].append([int(field, 16) for field in fields])
+    return dump
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--keymap-dir", default=os.path.dirname(os.path.abspath(__file__)), help="where sm_td.h and keymap.c are")
+    parser.add_argument("log", nargs="?", help="console log, standard input by default")
+    args = parser.parse_args()
+
+    names = load_names(args.keymap_dir)
+    with open(args.log) if args.log else sys.stdin as log:
+        dump = last_dump(log)
+    if dump is None:
+        sys.exit("no complete smtd-trace dump found")
+
+    begin, count, records = dump
+    if len(records) != count:
+        print("warning: %d records announced, %d read, the console dropped lines" % (count, len(records)), file=sys.stderr)
+
+    time = 0
+    for index, (delta, keycode, type_index, arg, stages, key) in enumerate(records):
+        # the first delta counts from the record before the ring wrapped, or from boot
+        time = 0 if index == 0 else time + delta
+        type_name = lookup(names["types"], type_index)
+        line = "%7d  %-7s  %s" % (time, type_name, describe(names, begin, type_name, keycode, arg, stages, key))
+        print(line.rstrip())
+
+
+if __name__ == "__main__":
+    main()
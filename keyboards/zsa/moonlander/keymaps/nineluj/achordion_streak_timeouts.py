@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""Generates achordion_streak_timeouts.h, the typing streak timeout of each (tap-hold key, next key) pair.
+
+Achordion takes a tap-hold key as a tap when the key after it comes within the streak timeout of
+the key before it. This measures that window in typing logs: for every pair that starts on a home
+row mod, the time from the key before the mod to the key after it, over every time the three were
+typed in a row. The timeout of a pair is a high percentile of those times, so that its streaks are
+recognized, clamped to a sane range. Pairs seen too rarely keep the default of
+achordion_streak_timeout().
+
+A log has one key press per line, "TIME KEY", the time in milliseconds and the key as the character
+it types, or "space". Other lines are skipped, and a pause longer than --max-gap splits the log.
+
+Usage: achordion_streak_timeouts.py [--percentile P] [--min-samples N] LOG... > achordion_streak_timeouts.h
+
+keymap.c includes the header once both ACHORDION_STREAK and ACHORDION_STREAK_TIMEOUTS are defined in
+config.h.
+"""
+
+import argparse
+import collections
+import sys
+
+# The letters of the home row mods of the base layer
+TAP_HOLD_KEYS = "arstneio"
+
+# The keycodes of the keys that continue a streak, see achordion_streak_continue()
+KEYCODES = {chr(ord("a") + i): ("KC_" + chr(ord("A") + i), 0x04 + i) for i in range(26)}
+KEYCODES.update({" ": ("KC_SPACE", 0x2C), "'": ("KC_QUOTE", 0x34), ",": ("KC_COMMA", 0x36), ".": ("KC_DOT", 0x37)})
+
+# Timeouts are stored in units of 4 ms in a byte, and the streak timer of achordion.c expires after 800 ms
+MIN_TIMEOUT = 40
+MAX_TIMEOUT = 800
+
+
+def read_presses(path, max_gap):
+    """Yields the runs of (time, key) presses of a log, split at pauses and unknown keys"""
+    run = []
+    with open(path, encoding="utf-8", errors="ignore") as log:
+        for line in log:
+            fields = line.rstrip("\n").split(" ", 1)
+            if len(fields) != 2 or not fields[0].isdigit():
+                continue
+            time, key = int(fields[0]), fields[1].lower()
+            key = " " if key == "space" else key
+            if key not in KEYCODES or (run and time - run[-1][0] > max_gap):
+                if len(run) >= 3:
+                    yield run
+                run = []
+            if key in KEYCODES:
+                run.append((time, key))
+    if len(run) >= 3:
+        yield run
+
+
+def percentile(values, share):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * share / 100))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--percentile", type=float, default=95, help="percentile of the measured windows the timeout covers")
+    parser.add_argument("--min-samples", type=int, default=20, help="times a pair must be seen to get its own timeout")
+    parser.add_argument("--max-gap", type=int, default=1000, help="pause in milliseconds that ends a run of typing")
+    parser.add_argument("log", nargs="*")
+    args = parser.parse_args()
+
+    presses = 0
+    windows = collections.defaultdict(list)
+    for path in args.log:
+        for run in read_presses(path, args.max_gap):
+            presses += len(run)
+            for (before, _), (_, key), (after, next_key) in zip(run, run[1:], run[2:]):
+                if key in TAP_HOLD_KEYS:
+                    windows[key, next_key].append(after - before)
+
+    entries = []
+    for (key, next_key), times in windows.items():
+        if len(times) < args.min_samples:
+            continue
+        timeout = min(MAX_TIMEOUT, max(MIN_TIMEOUT, percentile(times, args.percentile)))
+        entries.append((KEYCODES[key], KEYCODES[next_key], (timeout + 3) // 4 * 4, len(times)))
+    # achordion.c looks pairs up by binary search, so they are sorted by keycode values
+    entries.sort(key=lambda entry: (entry[0][1], entry[1][1]))
+
+    out = sys.stdout
+    out.write("// Generated by achordion_streak_timeouts.py --percentile %g --min-samples %d, do not edit\n" % (args.percentile, args.min_samples))
+    out.write("// %d key presses read, pairs are sorted by keycode, the comments count the samples\n" % presses)
+    out.write("#pragma once\n\n")
+    lines = ["#define ACHORDION_STREAK_TIMEOUT_PAIRS(X)"]
+    lines += ["  X(%s, %s, %d) /* %d */" % (first[0], second[0], timeout, count) for first, second, timeout, count in entries]
+    width = max(len(line) for line in lines) + 1
+    for i, line in enumerate(lines):
+        out.write(line + (" " * (width - len(line)) + "\\" if i < len(lines) - 1 else "") + "\n")
+
+
+if __name__ == "__main__":
+    main()
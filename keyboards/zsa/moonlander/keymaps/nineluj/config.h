@@ -13,3 +13,5 @@
 
 #define TAPPING_TERM_PER_KEY
 #define RGB_MATRIX_STARTUP_SPD 60
+
+#define ACHORDION_POSITIONS
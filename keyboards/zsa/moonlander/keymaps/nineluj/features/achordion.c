@@ -28,65 +28,263 @@
 #error "achordion: QMK version is too old to build. Please update QMK."
 #else
 
-// Copy of the `record` and `keycode` args for the current active tap-hold key.
-static keyrecord_t tap_hold_record;
-static uint16_t tap_hold_keycode = KC_NO;
-// Timeout timer. When it expires, the key is considered held.
-static uint16_t hold_timer = 0;
-// Eagerly applied mods, if any.
-static uint8_t eager_mods = 0;
-// Flag to determine whether another key is pressed within the timeout.
-static bool pressed_another_key_before_release = false;
-
-#ifdef ACHORDION_STREAK
-// Timer for typing streak
-static uint16_t streak_timer = 0;
-#else
-// When disabled, is_streak is never true
-#define is_streak false
+#ifndef ACHORDION_POOL_SIZE
+#define ACHORDION_POOL_SIZE 4
 #endif
 
-// Achordion's current state.
+// Achordion's state for a tap-hold key.
 enum {
   // A tap-hold key is pressed, but hasn't yet been settled as tapped or held.
   STATE_UNSETTLED,
-  // Achordion is inactive.
+  // The slot is free.
   STATE_RELEASED,
-  // Active tap-hold key has been settled as tapped.
+  // The tap-hold key has been settled as tapped.
   STATE_TAPPING,
-  // Active tap-hold key has been settled as held.
+  // The tap-hold key has been settled as held.
   STATE_HOLDING,
-  // This state is set while calling `process_record()`, which will recursively
-  // call `process_achordion()`. This state is checked so that we don't process
-  // events generated by Achordion and potentially create an infinite loop.
-  STATE_RECURSING,
 };
-static uint8_t achordion_state = STATE_RELEASED;
+
+// A tap-hold key tracked from its press until its release.
+typedef struct {
+  // Copy of the `record` and `keycode` args of the press.
+  keyrecord_t record;
+  uint16_t keycode;
+  // Timeout timer. When it expires, the key is considered held.
+  uint16_t hold_timer;
+  // Eagerly applied mods, if any.
+  uint8_t eager_mods;
+  // Whether the layer of a layer-tap key is eagerly on.
+  bool eager_layer;
+  // Set for a key looked up again after an eager layer was rolled back. QMK's
+  // tap-hold handling never saw it as a tap-hold key, so it is tapped if
+  // released before being settled.
+  bool tap_on_release;
+  uint8_t state;
+} tap_hold_t;
+
+// Tracked tap-hold keys in press order, each with its own timeout. The first
+// `pool_size` entries are in use.
+static tap_hold_t pool[ACHORDION_POOL_SIZE];
+static uint8_t pool_size = 0;
+
+// This flag is set while calling `process_record()`, which will recursively
+// call `process_achordion()`. It is checked so that we don't process events
+// generated by Achordion and potentially create an infinite loop.
+static bool recursing = false;
+
+// Set while a press is passed to `process_record()` again after the unsettled
+// keys were settled by it, because the layers changed under it. The press is
+// then looked up on the new layers and tracked if a tap-hold key, but it
+// doesn't settle any key a second time.
+static bool reprocessing = false;
+// Set with `reprocessing` when the layers changed because an eager layer was
+// rolled back, see `tap_hold_t::tap_on_release`.
+static bool reprocessing_rolled_back = false;
+
+// The earliest time `achordion_task()` may have work to do, valid while
+// `deadline_armed` is set. Deadlines are armed as they are set, but not
+// disarmed when a key settles before its timeout. So this is a lower bound,
+// and `achordion_task()` recomputes it once it is reached.
+static uint16_t next_deadline = 0;
+static bool deadline_armed = false;
+
+static void arm_deadline(uint16_t deadline) {
+  if (!deadline_armed || timer_expired(next_deadline, deadline)) {
+    next_deadline = deadline;
+    deadline_armed = true;
+  }
+}
+
+#ifdef ACHORDION_STREAK
+// Timer for typing streak
+static uint16_t streak_timer = 0;
+// After this long without a key event, the streak timer is cleared so that it
+// can't be taken for a recent one once the 16-bit timer wraps around.
+#define MAX_STREAK_TIMEOUT 800
+#else
+// When disabled, is_streak is never true
+#define is_streak false
+#endif
 
 #ifdef ACHORDION_STREAK
 static void update_streak_timer(uint16_t keycode, keyrecord_t* record) {
   if (achordion_streak_continue(keycode)) {
     // We use 0 to represent an unset timer, so `| 1` to force a nonzero value.
     streak_timer = record->event.time | 1;
+    arm_deadline(streak_timer + MAX_STREAK_TIMEOUT);
   } else {
     streak_timer = 0;
   }
 }
 #endif
 
+#ifdef ACHORDION_STATS
+#ifndef ACHORDION_STATS_KEYS
+#define ACHORDION_STATS_KEYS 16
+#endif
+#ifndef ACHORDION_STATS_BUCKETS
+#define ACHORDION_STATS_BUCKETS 12
+#endif
+
+typedef uint16_t stats_histogram_t[ACHORDION_STATS_BUCKETS];
+
+// Decision counters of a keycode, indexed by path, then 0 for tap and 1 for
+// hold.
+typedef struct {
+  uint16_t keycode;
+  uint16_t counts[ACHORDION_PATH_COUNT][2];
+} stats_key_t;
+
+static stats_key_t stats_keys[ACHORDION_STATS_KEYS];
+static uint8_t stats_keys_size = 0;
+// Decisions of keycodes that found no free entry in `stats_keys`.
+static uint16_t stats_dropped = 0;
+// Press to decision time, indexed like `stats_key_t::counts`.
+static stats_histogram_t stats_latency[ACHORDION_PATH_COUNT][2];
+
+static void stats_increment(uint16_t* counter) {
+  if (*counter < UINT16_MAX) {
+    ++*counter;
+  }
+}
+
+// Counts the decision of a tap-hold key made at `time`, before it's settled.
+static void stats_count(const tap_hold_t* tap_hold, achordion_path_t path,
+                        bool held, uint16_t time) {
+  const uint16_t elapsed = time - tap_hold->record.event.time;
+  uint8_t bucket = elapsed ? 32 - __builtin_clz(elapsed) : 0;
+  if (bucket >= ACHORDION_STATS_BUCKETS) {
+    bucket = ACHORDION_STATS_BUCKETS - 1;
+  }
+  stats_increment(&stats_latency[path][held][bucket]);
+
+  uint8_t i = 0;
+  while (i < stats_keys_size && stats_keys[i].keycode != tap_hold->keycode) {
+    ++i;
+  }
+  if (i == stats_keys_size) {
+    if (stats_keys_size == ACHORDION_STATS_KEYS) {
+      stats_increment(&stats_dropped);
+      return;
+    }
+    stats_keys[stats_keys_size++].keycode = tap_hold->keycode;
+  }
+  stats_increment(&stats_keys[i].counts[path][held]);
+}
+
+#define STATS_COUNT(tap_hold, path, held, time) \
+  stats_count(tap_hold, path, held, time)
+#else
+#define STATS_COUNT(tap_hold, path, held, time)
+#endif
+
+// Returns the tracked tap-hold key at `pos`, or NULL.
+static tap_hold_t* find_tap_hold(keypos_t pos) {
+  for (uint8_t i = 0; i < pool_size; ++i) {
+    if (KEYEQ(pool[i].record.event.key, pos)) {
+      return &pool[i];
+    }
+  }
+  return NULL;
+}
+
+static bool any_unsettled(void) {
+  for (uint8_t i = 0; i < pool_size; ++i) {
+    if (pool[i].state == STATE_UNSETTLED) {
+      return true;
+    }
+  }
+  return false;
+}
+
 // Presses or releases eager_mods through process_action(), which skips the
 // usual event handling pipeline. The action is considered as a mod-tap hold or
 // release, with Retro Tapping if enabled.
-static void process_eager_mods_action(void) {
+static void process_eager_mods_action(tap_hold_t* tap_hold) {
   action_t action;
   action.code = ACTION_MODS_TAP_KEY(
-      eager_mods, QK_MOD_TAP_GET_TAP_KEYCODE(tap_hold_keycode));
-  process_action(&tap_hold_record, action);
+      tap_hold->eager_mods, QK_MOD_TAP_GET_TAP_KEYCODE(tap_hold->keycode));
+  process_action(&tap_hold->record, action);
+}
+
+// Turns the eager layer on or off like process_eager_mods_action() does mods,
+// the action is considered as a layer-tap hold or release.
+static void process_eager_layer_action(tap_hold_t* tap_hold) {
+  action_t action;
+  action.code =
+      ACTION_LAYER_TAP_KEY(QK_LAYER_TAP_GET_LAYER(tap_hold->keycode),
+                           QK_LAYER_TAP_GET_TAP_KEYCODE(tap_hold->keycode));
+  process_action(&tap_hold->record, action);
+}
+
+// Applies the mods of a mod-tap key or the layer of a layer-tap key right
+// away, if they are "eager."
+static void apply_eager(tap_hold_t* tap_hold) {
+  const uint16_t keycode = tap_hold->keycode;
+  if (IS_QK_MOD_TAP(keycode)) {
+    const uint8_t mod = mod_config(QK_MOD_TAP_GET_MODS(keycode));
+    if (
+#if defined(CAPS_WORD_ENABLE) && defined(CAPS_WORD_INVERT_ON_SHIFT)
+        // Since eager mods bypass normal event handling, eager Shift does
+        // not work with CAPS_WORD_INVERT_ON_SHIFT. So if this option is
+        // enabled, we don't apply Shift eagerly when Caps Word is on.
+        !(is_caps_word_on() && (mod & MOD_LSFT) != 0) &&
+#endif  // defined(CAPS_WORD_ENABLE) && defined(CAPS_WORD_INVERT_ON_SHIFT)
+        achordion_eager_mod(mod)) {
+      tap_hold->eager_mods = mod;
+      process_eager_mods_action(tap_hold);
+    }
+  } else if (IS_QK_LAYER_TAP(keycode) &&
+             achordion_eager_layer(QK_LAYER_TAP_GET_LAYER(keycode))) {
+    tap_hold->eager_layer = true;
+    process_eager_layer_action(tap_hold);
+  }
+}
+
+// Returns true if a tracked layer-tap key other than `tap_hold` holds `layer`,
+// eagerly or settled as held.
+static bool layer_held_by_other(const tap_hold_t* tap_hold, uint8_t layer) {
+  for (uint8_t i = 0; i < pool_size; ++i) {
+    const tap_hold_t* other = &pool[i];
+    if (other != tap_hold && IS_QK_LAYER_TAP(other->keycode) &&
+        QK_LAYER_TAP_GET_LAYER(other->keycode) == layer &&
+        (other->eager_layer || other->state == STATE_HOLDING)) {
+      return true;
+    }
+  }
+  return false;
 }
 
-// Calls `process_record()` with state set to RECURSING.
-static void recursively_process_record(keyrecord_t* record, uint8_t state) {
-  achordion_state = STATE_RECURSING;
+// Takes back eager mods or an eager layer, if set.
+static void clear_eager(tap_hold_t* tap_hold) {
+  if (tap_hold->eager_mods) {
+#if defined(RETRO_TAPPING) || defined(RETRO_TAPPING_PER_KEY)
+#ifdef DUMMY_MOD_NEUTRALIZER_KEYCODE
+    neutralize_flashing_modifiers(get_mods());
+#endif  // DUMMY_MOD_NEUTRALIZER_KEYCODE
+#endif  // defined(RETRO_TAPPING) || defined(RETRO_TAPPING_PER_KEY)
+    tap_hold->record.event.pressed = false;
+    // To avoid falsely triggering Retro Tapping, process eager mods release as
+    // a regular mods release rather than a mod-tap release.
+    action_t action;
+    action.code = ACTION_MODS(tap_hold->eager_mods);
+    process_action(&tap_hold->record, action);
+    tap_hold->eager_mods = 0;
+  }
+  if (tap_hold->eager_layer) {
+    // Likewise, roll the layer back without going through a layer-tap release,
+    // unless another tracked key holds it too.
+    const uint8_t layer = QK_LAYER_TAP_GET_LAYER(tap_hold->keycode);
+    if (!layer_held_by_other(tap_hold, layer)) {
+      layer_off(layer);
+    }
+    tap_hold->eager_layer = false;
+  }
+}
+
+// Calls `process_record()` with the recursing flag set.
+static void recursively_process_record(keyrecord_t* record) {
+  recursing = true;
 #if defined(POINTING_DEVICE_ENABLE) && defined(POINTING_DEVICE_AUTO_MOUSE_ENABLE)
   int8_t mouse_key_tracker = get_auto_mouse_key_tracker();
 #endif
@@ -94,46 +292,43 @@ static void recursively_process_record(keyrecord_t* record, uint8_t state) {
 #if defined(POINTING_DEVICE_ENABLE) && defined(POINTING_DEVICE_AUTO_MOUSE_ENABLE)
   set_auto_mouse_key_tracker(mouse_key_tracker);
 #endif
-  achordion_state = state;
+  recursing = false;
+}
+
+// Passes a press to `process_record()` again with the reprocessing flags set.
+static void reprocess_record(keyrecord_t* record, bool rolled_back) {
+  reprocessing = true;
+  reprocessing_rolled_back = rolled_back;
+  process_record(record);
+  reprocessing = false;
+  reprocessing_rolled_back = false;
 }
 
-// Sends hold press event and settles the active tap-hold key as held.
-static void settle_as_hold(void) {
-  if (eager_mods) {
-    // If eager mods are being applied, nothing needs to be done besides
-    // updating the state.
-    dprintln("Achordion: Settled eager mod as hold.");
-    achordion_state = STATE_HOLDING;
+// Sends hold press event and settles the tap-hold key as held.
+static void settle_as_hold(tap_hold_t* tap_hold) {
+  tap_hold->state = STATE_HOLDING;
+  if (tap_hold->eager_mods || tap_hold->eager_layer) {
+    // If eager mods or an eager layer are being applied, nothing needs to be
+    // done besides updating the state.
+    dprintln("Achordion: Settled eager mod or layer as hold.");
   } else {
     // Create hold press event.
     dprintln("Achordion: Plumbing hold press.");
-    recursively_process_record(&tap_hold_record, STATE_HOLDING);
+    recursively_process_record(&tap_hold->record);
   }
 }
 
-// Sends tap press and release and settles the active tap-hold key as tapped.
-static void settle_as_tap(void) {
-  if (eager_mods) {  // Clear eager mods if set.
-#if defined(RETRO_TAPPING) || defined(RETRO_TAPPING_PER_KEY)
-#ifdef DUMMY_MOD_NEUTRALIZER_KEYCODE
-    neutralize_flashing_modifiers(get_mods());
-#endif  // DUMMY_MOD_NEUTRALIZER_KEYCODE
-#endif  // defined(RETRO_TAPPING) || defined(RETRO_TAPPING_PER_KEY)
-    tap_hold_record.event.pressed = false;
-    // To avoid falsely triggering Retro Tapping, process eager mods release as
-    // a regular mods release rather than a mod-tap release.
-    action_t action;
-    action.code = ACTION_MODS(eager_mods);
-    process_action(&tap_hold_record, action);
-    eager_mods = 0;
-  }
+// Sends tap press and release and settles the tap-hold key as tapped.
+static void settle_as_tap(tap_hold_t* tap_hold) {
+  tap_hold->state = STATE_TAPPING;
+  clear_eager(tap_hold);
 
   dprintln("Achordion: Plumbing tap press.");
-  tap_hold_record.event.pressed = true;
-  tap_hold_record.tap.count = 1;  // Revise event as a tap.
-  tap_hold_record.tap.interrupted = true;
+  tap_hold->record.event.pressed = true;
+  tap_hold->record.tap.count = 1;  // Revise event as a tap.
+  tap_hold->record.tap.interrupted = true;
   // Plumb tap press event.
-  recursively_process_record(&tap_hold_record, STATE_TAPPING);
+  recursively_process_record(&tap_hold->record);
 
   send_keyboard_report();
 #if TAP_CODE_DELAY > 0
@@ -141,180 +336,237 @@ static void settle_as_tap(void) {
 #endif  // TAP_CODE_DELAY > 0
 
   dprintln("Achordion: Plumbing tap release.");
-  tap_hold_record.event.pressed = false;
+  tap_hold->record.event.pressed = false;
   // Plumb tap release event.
-  recursively_process_record(&tap_hold_record, STATE_TAPPING);
+  recursively_process_record(&tap_hold->record);
+}
+
+// Starts tracking a tap-hold key that QMK considers held. Returns false if the
+// key is left to the default handling.
+static bool track_tap_hold(uint16_t keycode, keyrecord_t* record) {
+  const uint16_t timeout = achordion_timeout(keycode);
+  if (timeout == 0 || pool_size == ACHORDION_POOL_SIZE) {
+    return false;
+  }
+
+  tap_hold_t* tap_hold = &pool[pool_size++];
+  tap_hold->keycode = keycode;
+  tap_hold->record = *record;
+  tap_hold->hold_timer = record->event.time + timeout;
+  arm_deadline(tap_hold->hold_timer);
+  tap_hold->eager_mods = 0;
+  tap_hold->eager_layer = false;
+  tap_hold->tap_on_release = reprocessing_rolled_back;
+  tap_hold->state = STATE_UNSETTLED;
+  apply_eager(tap_hold);
+
+  dprintf("Achordion: Key 0x%04X pressed.%s\n", keycode,
+          tap_hold->eager_mods    ? " Set eager mods."
+          : tap_hold->eager_layer ? " Set eager layer."
+                                  : "");
+  return true;
+}
+
+// Handles the release of a tracked tap-hold key and frees its slot.
+static void release_tap_hold(tap_hold_t* tap_hold, uint16_t release_time) {
+  if (tap_hold->state == STATE_UNSETTLED) {
+    STATS_COUNT(tap_hold, ACHORDION_PATH_RELEASE, !tap_hold->tap_on_release,
+                release_time);
+  }
+  if (tap_hold->state == STATE_UNSETTLED && tap_hold->tap_on_release) {
+    dprintln("Achordion: Key released. Plumbing tap.");
+    settle_as_tap(tap_hold);
+  } else if (tap_hold->eager_mods) {
+    dprintln("Achordion: Key released. Clearing eager mods.");
+    tap_hold->record.event.pressed = false;
+    process_eager_mods_action(tap_hold);
+  } else if (tap_hold->eager_layer) {
+    dprintln("Achordion: Key released. Clearing eager layer.");
+    tap_hold->record.event.pressed = false;
+    process_eager_layer_action(tap_hold);
+  } else if (tap_hold->state == STATE_HOLDING) {
+    dprintln("Achordion: Key released. Plumbing hold release.");
+    tap_hold->record.event.pressed = false;
+    // Plumb hold release event.
+    recursively_process_record(&tap_hold->record);
+  } else if (tap_hold->state == STATE_UNSETTLED) {
+    // No key has settled the tap-hold key before its release, plumb a hold
+    // press and then a release.
+    dprintln("Achordion: Key released. Plumbing hold press and release.");
+    recursively_process_record(&tap_hold->record);
+    tap_hold->record.event.pressed = false;
+    recursively_process_record(&tap_hold->record);
+  } else {
+    dprintln("Achordion: Key released.");
+  }
+
+  const uint8_t i = tap_hold - pool;
+  memmove(&pool[i], &pool[i + 1], (--pool_size - i) * sizeof(tap_hold_t));
 }
 
 bool process_achordion(uint16_t keycode, keyrecord_t* record) {
   // Don't process events that Achordion generated.
-  if (achordion_state == STATE_RECURSING) {
+  if (recursing) {
     return true;
   }
 
   // Determine whether the current event is for a mod-tap or layer-tap key.
-  const bool is_mt = IS_QK_MOD_TAP(keycode);
-  const bool is_tap_hold = is_mt || IS_QK_LAYER_TAP(keycode);
+  const bool is_tap_hold = IS_QK_MOD_TAP(keycode) || IS_QK_LAYER_TAP(keycode);
   // Check that this is a normal key event, don't act on combos.
   const bool is_key_event = IS_KEYEVENT(record->event);
-
-  // Event while no tap-hold key is active.
-  if (achordion_state == STATE_RELEASED) {
-    if (is_tap_hold && record->tap.count == 0 && record->event.pressed &&
-        is_key_event) {
-      // A tap-hold key is pressed and considered by QMK as "held".
-      const uint16_t timeout = achordion_timeout(keycode);
-      if (timeout > 0) {
-        achordion_state = STATE_UNSETTLED;
-        // Save info about this key.
-        tap_hold_keycode = keycode;
-        tap_hold_record = *record;
-        hold_timer = record->event.time + timeout;
-        pressed_another_key_before_release = false;
-        eager_mods = 0;
-
-        if (is_mt) {  // Apply mods immediately if they are "eager."
-          const uint8_t mod = mod_config(QK_MOD_TAP_GET_MODS(keycode));
-          if (
-#if defined(CAPS_WORD_ENABLE) && defined(CAPS_WORD_INVERT_ON_SHIFT)
-              // Since eager mods bypass normal event handling, eager Shift does
-              // not work with CAPS_WORD_INVERT_ON_SHIFT. So if this option is
-              // enabled, we don't apply Shift eagerly when Caps Word is on.
-              !(is_caps_word_on() && (mod & MOD_LSFT) != 0) &&
-#endif  // defined(CAPS_WORD_ENABLE) && defined(CAPS_WORD_INVERT_ON_SHIFT)
-              achordion_eager_mod(mod)) {
-            eager_mods = mod;
-            process_eager_mods_action();
-          }
-        }
-
-        dprintf("Achordion: Key 0x%04X pressed.%s\n", keycode,
-                eager_mods ? " Set eager mods." : "");
-        return false;  // Skip default handling.
-      }
-    }
-
-#ifdef ACHORDION_STREAK
-    update_streak_timer(keycode, record);
-#endif
-    return true;  // Otherwise, continue with default handling.
-  } else if (record->event.pressed && tap_hold_keycode != keycode) {
-    // Track whether another key was pressed while using a tap-hold key.
-    pressed_another_key_before_release = true;
-  }
-
-  // Release of the active tap-hold key.
-  if (keycode == tap_hold_keycode && !record->event.pressed) {
-    if (eager_mods) {
-      dprintln("Achordion: Key released. Clearing eager mods.");
-      tap_hold_record.event.pressed = false;
-      process_eager_mods_action();
-    } else if (achordion_state == STATE_HOLDING) {
-      dprintln("Achordion: Key released. Plumbing hold release.");
-      tap_hold_record.event.pressed = false;
-      // Plumb hold release event.
-      recursively_process_record(&tap_hold_record, STATE_RELEASED);
-    } else if (!pressed_another_key_before_release) {
-      // No other key was pressed between the press and release of the tap-hold
-      // key, plumb a hold press and then a release.
-      dprintln("Achordion: Key released. Plumbing hold press and release.");
-      recursively_process_record(&tap_hold_record, STATE_HOLDING);
-      tap_hold_record.event.pressed = false;
-      recursively_process_record(&tap_hold_record, STATE_RELEASED);
-    } else {
-      dprintln("Achordion: Key released.");
+  // A tap-hold key is pressed and considered by QMK as "held".
+  const bool is_held_tap_hold = is_tap_hold && record->tap.count == 0 &&
+                                record->event.pressed && is_key_event;
+
+  // Release of a tracked tap-hold key.
+  if (!record->event.pressed && is_key_event) {
+    tap_hold_t* tap_hold = find_tap_hold(record->event.key);
+    if (tap_hold != NULL) {
+      release_tap_hold(tap_hold, record->event.time);
+      return false;
     }
-
-    achordion_state = STATE_RELEASED;
-    tap_hold_keycode = KC_NO;
-    return false;
   }
 
-  if (achordion_state == STATE_UNSETTLED && record->event.pressed) {
-#ifdef ACHORDION_STREAK
-    const uint16_t s_timeout =
-        achordion_streak_chord_timeout(tap_hold_keycode, keycode);
-    const bool is_streak =
-        streak_timer && s_timeout &&
-        !timer_expired(record->event.time, (streak_timer + s_timeout));
-#endif
-
-    // Press event occurred on a key other than the active tap-hold key.
-
+  if (record->event.pressed && !reprocessing && any_unsettled()) {
+    // Press event occurred on a key other than the unsettled tap-hold key.
+    //
     // If the other key is *also* a tap-hold key and considered by QMK to be
-    // held, then we settle the active key as held. This way, things like
-    // chording multiple home row modifiers will work, but let's our logic
-    // consider simply a single tap-hold key as "active" at a time.
+    // held, then we settle the unsettled key as held. This way, things like
+    // chording multiple home row modifiers will work, while the other key is
+    // tracked with its own timeout and chord decision.
     //
     // Otherwise, we call `achordion_chord()` to determine whether to settle the
     // tap-hold key as tapped vs. held. We implement the tap or hold by plumbing
     // events back into the handling pipeline so that QMK features and other
     // user code can see them. This is done by calling `process_record()`, which
     // in turn calls most handlers including `process_record_user()`.
-    if (!is_streak &&
-        (!is_key_event || (is_tap_hold && record->tap.count == 0) ||
-         achordion_chord(tap_hold_keycode, &tap_hold_record, keycode,
-                         record))) {
-      settle_as_hold();
+    const layer_state_t layers = layer_state;
+    bool rolled_back = false;
+    for (uint8_t i = 0; i < pool_size; ++i) {
+      tap_hold_t* tap_hold = &pool[i];
+      if (tap_hold->state != STATE_UNSETTLED) {
+        continue;
+      }
 
-#ifdef REPEAT_KEY_ENABLE
-      // Edge case involving LT + Repeat Key: in a sequence of "LT down, other
-      // down" where "other" is on the other layer in the same position as
-      // Repeat or Alternate Repeat, the repeated keycode is set instead of the
-      // the one on the switched-to layer. Here we correct that.
-      if (get_repeat_key_count() != 0 && IS_QK_LAYER_TAP(tap_hold_keycode)) {
-        record->keycode = KC_NO;  // Forget the repeated keycode.
-        clear_weak_mods();
+#ifdef ACHORDION_STREAK
+      const uint16_t s_timeout =
+          achordion_streak_chord_timeout(tap_hold->keycode, keycode);
+      const bool is_streak =
+          streak_timer && s_timeout &&
+          !timer_expired(record->event.time, (streak_timer + s_timeout));
+#endif
+
+      if (!is_streak &&
+          (!is_key_event || is_held_tap_hold ||
+           achordion_chord(tap_hold->keycode, &tap_hold->record, keycode,
+                           record))) {
+        STATS_COUNT(tap_hold, ACHORDION_PATH_CHORD, true, record->event.time);
+        settle_as_hold(tap_hold);
+      } else {
+        STATS_COUNT(tap_hold,
+                    is_streak ? ACHORDION_PATH_STREAK : ACHORDION_PATH_CHORD,
+                    false, record->event.time);
+        rolled_back |= tap_hold->eager_layer;
+        settle_as_tap(tap_hold);
+#ifdef ACHORDION_STREAK
+        update_streak_timer(tap_hold->keycode, &tap_hold->record);
+#endif
       }
+    }
+
+#ifdef REPEAT_KEY_ENABLE
+    // Edge case involving LT + Repeat Key: in a sequence of "LT down, other
+    // down" where "other" is on the other layer in the same position as
+    // Repeat or Alternate Repeat, the repeated keycode is set instead of the
+    // the one on the switched-to layer. Here we correct that.
+    if (layer_state != layers && get_repeat_key_count() != 0) {
+      record->keycode = KC_NO;  // Forget the repeated keycode.
+      clear_weak_mods();
+    }
 #endif  // REPEAT_KEY_ENABLE
-    } else {
-      settle_as_tap();
 
+    if (rolled_back) {
+      // This key was looked up on an eager layer that has been rolled back. It
+      // is processed again, and tracked if a tap-hold key on the layer below.
+      reprocess_record(record, true);
+      return false;
+    }
+    if (!is_held_tap_hold) {
 #ifdef ACHORDION_STREAK
       update_streak_timer(keycode, record);
-      if (is_streak && is_key_event && is_tap_hold && record->tap.count == 0) {
-        // If we are in a streak and resolved the current tap-hold key as a tap
-        // consider the next tap-hold key as active to be resolved next.
-        update_streak_timer(tap_hold_keycode, &tap_hold_record);
-        const uint16_t timeout = achordion_timeout(keycode);
-        tap_hold_keycode = keycode;
-        tap_hold_record = *record;
-        hold_timer = record->event.time + timeout;
-        achordion_state = STATE_UNSETTLED;
-        pressed_another_key_before_release = false;
-        return false;
-      }
 #endif
+      recursively_process_record(record);  // Re-process event.
+      return false;  // Block the original event.
     }
+    if (layer_state != layers) {
+      // A layer-tap key settled as held may have changed the keycode of this
+      // key, so it is looked up again, and tracked if still a tap-hold key.
+      reprocess_record(record, false);
+      return false;
+    }
+  }
 
-    recursively_process_record(record, achordion_state);  // Re-process event.
-    return false;  // Block the original event.
+  if (is_held_tap_hold && track_tap_hold(keycode, record)) {
+    return false;  // Skip default handling.
   }
 
 #ifdef ACHORDION_STREAK
   // update idle timer on regular keys event
   update_streak_timer(keycode, record);
 #endif
-  return true;
+  return true;  // Otherwise, continue with default handling.
 }
 
 void achordion_task(void) {
-  if (achordion_state == STATE_UNSETTLED &&
-      timer_expired(timer_read(), hold_timer)) {
-    settle_as_hold();  // Timeout expired, settle the key as held.
+  if (!deadline_armed) {
+    return;  // Nothing is pending.
+  }
+  const uint16_t now = timer_read();
+  if (!timer_expired(now, next_deadline)) {
+    return;  // Nothing is due.
+  }
+  deadline_armed = false;
+
+  // Each unsettled key whose timeout expired is settled as held, the others
+  // arm the next deadline.
+  for (uint8_t i = 0; i < pool_size; ++i) {
+    if (pool[i].state != STATE_UNSETTLED) {
+      continue;
+    }
+    if (timer_expired(now, pool[i].hold_timer)) {
+      STATS_COUNT(&pool[i], ACHORDION_PATH_TIMEOUT, true, now);
+      settle_as_hold(&pool[i]);
+    } else {
+      arm_deadline(pool[i].hold_timer);
+    }
   }
 
 #ifdef ACHORDION_STREAK
-#define MAX_STREAK_TIMEOUT 800
-  if (streak_timer &&
-      timer_expired(timer_read(), (streak_timer + MAX_STREAK_TIMEOUT))) {
-    streak_timer = 0;  // Expired.
+  if (streak_timer) {
+    if (timer_expired(now, (streak_timer + MAX_STREAK_TIMEOUT))) {
+      streak_timer = 0;  // Expired.
+    } else {
+      arm_deadline(streak_timer + MAX_STREAK_TIMEOUT);
+    }
   }
 #endif
 }
 
+uint8_t achordion_position(keypos_t pos) {
+#ifdef ACHORDION_POSITIONS
+  if (pos.row < MATRIX_ROWS && pos.col < MATRIX_COLS) {
+    return pgm_read_byte(&achordion_positions[pos.row][pos.col]);
+  }
+#endif
+  return 0;
+}
+
 // Returns true if `pos` on the left hand of the keyboard, false if right.
 static bool on_left_hand(keypos_t pos) {
+  const uint8_t position = achordion_position(pos);
+  if (position) {
+    return ACHORDION_POSITION_HAND(position) == ACHORDION_LEFT;
+  }
 #ifdef SPLIT_KEYBOARD
   return pos.row < MATRIX_ROWS / 2;
 #else
@@ -329,6 +581,42 @@ bool achordion_opposite_hands(const keyrecord_t* tap_hold_record,
          on_left_hand(other_record->event.key);
 }
 
+bool achordion_on_thumb(const keyrecord_t* record) {
+  const uint8_t position = achordion_position(record->event.key);
+  return position && ACHORDION_POSITION_FINGER(position) == ACHORDION_THUMB;
+}
+
+bool achordion_thumb_involved(const keyrecord_t* tap_hold_record,
+                              const keyrecord_t* other_record) {
+  return achordion_on_thumb(tap_hold_record) ||
+         achordion_on_thumb(other_record);
+}
+
+// Returns the distance between the fingers of two known positions on the same
+// hand, or -1 if the positions are unknown or on opposite hands.
+static int8_t finger_distance(const keyrecord_t* tap_hold_record,
+                              const keyrecord_t* other_record) {
+  const uint8_t a = achordion_position(tap_hold_record->event.key);
+  const uint8_t b = achordion_position(other_record->event.key);
+  if (!a || !b || ACHORDION_POSITION_HAND(a) != ACHORDION_POSITION_HAND(b)) {
+    return -1;
+  }
+  const int8_t distance =
+      ACHORDION_POSITION_FINGER(a) - ACHORDION_POSITION_FINGER(b);
+  return distance < 0 ? -distance : distance;
+}
+
+bool achordion_same_finger(const keyrecord_t* tap_hold_record,
+                           const keyrecord_t* other_record) {
+  return finger_distance(tap_hold_record, other_record) == 0;
+}
+
+bool achordion_adjacent_fingers(const keyrecord_t* tap_hold_record,
+                                const keyrecord_t* other_record) {
+  return finger_distance(tap_hold_record, other_record) == 1 &&
+         !achordion_thumb_involved(tap_hold_record, other_record);
+}
+
 // By default, use the BILATERAL_COMBINATIONS rule to consider the tap-hold key
 // "held" only when it and the other key are on opposite hands.
 __attribute__((weak)) bool achordion_chord(uint16_t tap_hold_keycode,
@@ -348,6 +636,11 @@ __attribute__((weak)) bool achordion_eager_mod(uint8_t mod) {
   return (mod & (MOD_LALT | MOD_LGUI)) == 0;
 }
 
+// By default, no layer is eager.
+__attribute__((weak)) bool achordion_eager_layer(uint8_t layer) {
+  return false;
+}
+
 #ifdef ACHORDION_STREAK
 __attribute__((weak)) bool achordion_streak_continue(uint16_t keycode) {
   // If any mods other than shift or AltGr are held, don't continue the streak
@@ -369,8 +662,48 @@ __attribute__((weak)) bool achordion_streak_continue(uint16_t keycode) {
   return false;
 }
 
+#ifdef ACHORDION_STREAK_TIMEOUTS
+// Returns the basic keycode a key taps, or KC_NO.
+static uint8_t tapped_keycode(uint16_t keycode) {
+  if (IS_QK_MOD_TAP(keycode)) return QK_MOD_TAP_GET_TAP_KEYCODE(keycode);
+  if (IS_QK_LAYER_TAP(keycode)) return QK_LAYER_TAP_GET_TAP_KEYCODE(keycode);
+  return keycode <= 0xFF ? keycode : KC_NO;
+}
+
+// Returns the streak timeout of the pair in `achordion_streak_timeouts`, or 0
+// if the pair isn't listed.
+static uint16_t streak_table_timeout(uint16_t tap_hold_keycode,
+                                     uint16_t next_keycode) {
+  const uint16_t pair = tapped_keycode(tap_hold_keycode) << 8 |
+                        tapped_keycode(next_keycode);
+  uint8_t low = 0;
+  uint8_t high = achordion_streak_timeouts_size;
+  while (low < high) {
+    const uint8_t mid = (low + high) / 2;
+    const achordion_streak_timeout_t* entry = &achordion_streak_timeouts[mid];
+    const uint16_t mid_pair = pgm_read_byte(&entry->tap_hold_keycode) << 8 |
+                              pgm_read_byte(&entry->next_keycode);
+    if (mid_pair == pair) {
+      return pgm_read_byte(&entry->timeout) * 4;
+    } else if (mid_pair < pair) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return 0;
+}
+#endif
+
 __attribute__((weak)) uint16_t achordion_streak_chord_timeout(
     uint16_t tap_hold_keycode, uint16_t next_keycode) {
+#ifdef ACHORDION_STREAK_TIMEOUTS
+  const uint16_t timeout =
+      streak_table_timeout(tap_hold_keycode, next_keycode);
+  if (timeout) {
+    return timeout;
+  }
+#endif
   return achordion_streak_timeout(tap_hold_keycode);
 }
 
@@ -380,4 +713,57 @@ achordion_streak_timeout(uint16_t tap_hold_keycode) {
 }
 #endif
 
+#ifdef ACHORDION_STATS
+static const char* const stats_path_names[ACHORDION_PATH_COUNT] = {
+    "timeout", "chord", "streak", "release"};
+
+void achordion_stats_dump(void) {
+  printf("achordion decisions  timeout   chord  streak release\n");
+  for (uint8_t i = 0; i < stats_keys_size; ++i) {
+    for (uint8_t held = 0; held < 2; ++held) {
+      printf("0x%04X %-4s         ", stats_keys[i].keycode,
+             held ? "hold" : "tap");
+      for (uint8_t path = 0; path < ACHORDION_PATH_COUNT; ++path) {
+        printf(" %7u", stats_keys[i].counts[path][held]);
+      }
+      printf("\n");
+    }
+  }
+  printf("achordion decisions of uncounted keycodes: %u\n", stats_dropped);
+
+  printf("achordion latency, ms from     0");
+  for (uint8_t i = 1; i < ACHORDION_STATS_BUCKETS; ++i) {
+    printf(" %5u", 1u << (i - 1));
+  }
+  printf("\n");
+  for (uint8_t path = 0; path < ACHORDION_PATH_COUNT; ++path) {
+    for (uint8_t held = 0; held < 2; ++held) {
+      printf("%-7s %-4s              ", stats_path_names[path],
+             held ? "hold" : "tap");
+      for (uint8_t i = 0; i < ACHORDION_STATS_BUCKETS; ++i) {
+        printf(" %5u", stats_latency[path][held][i]);
+      }
+      printf("\n");
+    }
+  }
+}
+
+void achordion_stats_reset(void) {
+  memset(stats_keys, 0, sizeof(stats_keys));
+  stats_keys_size = 0;
+  stats_dropped = 0;
+  memset(stats_latency, 0, sizeof(stats_latency));
+}
+
+uint16_t achordion_stats_count(uint16_t keycode, achordion_path_t path,
+                               bool held) {
+  for (uint8_t i = 0; i < stats_keys_size; ++i) {
+    if (stats_keys[i].keycode == keycode) {
+      return stats_keys[i].counts[path][held];
+    }
+  }
+  return 0;
+}
+#endif
+
 #endif  // version check
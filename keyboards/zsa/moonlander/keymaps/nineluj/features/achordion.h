@@ -80,6 +80,9 @@ bool process_achordion(uint16_t keycode, keyrecord_t* record);
  *     void matrix_scan_user(void) {
  *       achordion_task();
  *     }
+ *
+ * With no key pending, this is a flag test and returns right away. Otherwise it
+ * reads the timer once and returns until the earliest pending timeout.
  */
 void achordion_task(void);
 
@@ -149,6 +152,33 @@ uint16_t achordion_timeout(uint16_t tap_hold_keycode);
  */
 bool achordion_eager_mod(uint8_t mod);
 
+/**
+ * Optional callback defining which layers are "eagerly" turned on.
+ *
+ * This callback defines which layers of layer-tap keys are turned on as soon
+ * as QMK considers the key held, while it is still being settled. The next key
+ * is then looked up on the layer right away, so `achordion_chord()` sees its
+ * keycode there.
+ *
+ * If the layer-tap key is settled as tapped, the layer is rolled back, unless
+ * another tracked layer-tap key holds it too, and the key that settled it is
+ * processed again on the layers below. Layers held by keys Achordion doesn't track, such
+ * as `MO()`, aren't known to it. A key that turns out to
+ * be a tap-hold key there was never handled by QMK as one, so it is tapped if
+ * released before it settles.
+ *
+ * Define this callback in your keymap.c. The default callback is eager for no
+ * layer:
+ *
+ *     bool achordion_eager_layer(uint8_t layer) {
+ *       return layer == NAV;
+ *     }
+ *
+ * @param layer Layer of the layer-tap key.
+ * @return True if the layer should be eagerly turned on.
+ */
+bool achordion_eager_layer(uint8_t layer);
+
 /**
  * Returns true if the args come from keys on opposite hands.
  *
@@ -159,6 +189,98 @@ bool achordion_eager_mod(uint8_t mod);
 bool achordion_opposite_hands(const keyrecord_t* tap_hold_record,
                               const keyrecord_t* other_record);
 
+/**
+ * Describe where each key sits under the hands by defining ACHORDION_POSITIONS
+ * and a table of the metadata of every matrix position, written with the
+ * keyboard's `LAYOUT()` macro like a keymap layer:
+ *
+ *    #define ACHORDION_POSITIONS  // In config.h.
+ *
+ *    const uint8_t PROGMEM achordion_positions[MATRIX_ROWS][MATRIX_COLS] =
+ *        LAYOUT(ACHORDION_POSITION(ACHORDION_LEFT, ACHORDION_PINKY, 0), ...);
+ *
+ * Each entry packs the hand, the finger and the row, 0 for the top row, in a
+ * byte. Positions left out, or 0, are unknown. `achordion_opposite_hands()`
+ * then goes by the table, and the predicates below can be used in
+ * `achordion_chord()`. Each is a table lookup, without keycode checks.
+ */
+enum achordion_hand { ACHORDION_LEFT, ACHORDION_RIGHT };
+
+enum achordion_finger {
+  ACHORDION_PINKY,
+  ACHORDION_RING,
+  ACHORDION_MIDDLE,
+  ACHORDION_INDEX,
+  ACHORDION_THUMB,
+};
+
+#define ACHORDION_POSITION(hand, finger, row) \
+  (0x80 | (hand) << 6 | (finger) << 3 | (row))
+#define ACHORDION_POSITION_HAND(position) (((position) >> 6) & 1)
+#define ACHORDION_POSITION_FINGER(position) (((position) >> 3) & 7)
+#define ACHORDION_POSITION_ROW(position) ((position) & 7)
+
+#ifdef ACHORDION_POSITIONS
+extern const uint8_t achordion_positions[MATRIX_ROWS][MATRIX_COLS];
+#endif
+
+/**
+ * Returns the metadata of a matrix position, see ACHORDION_POSITIONS.
+ *
+ * @param pos Matrix position.
+ * @return The packed metadata, or 0 if the position is unknown.
+ */
+uint8_t achordion_position(keypos_t pos);
+
+/**
+ * Returns true if the key of the record is pressed with a thumb.
+ *
+ * @param record keyrecord_t from the key's event.
+ * @return True if the key is a thumb key.
+ */
+bool achordion_on_thumb(const keyrecord_t* record);
+
+/**
+ * Returns true if either key is pressed with a thumb.
+ *
+ * @param tap_hold_record keyrecord_t from the tap-hold key's event.
+ * @param other_record keyrecord_t from the other key's event.
+ * @return True if a thumb key is involved.
+ */
+bool achordion_thumb_involved(const keyrecord_t* tap_hold_record,
+                              const keyrecord_t* other_record);
+
+/**
+ * Returns true if both keys are pressed with the same finger.
+ *
+ * @param tap_hold_record keyrecord_t from the tap-hold key's event.
+ * @param other_record keyrecord_t from the other key's event.
+ * @return True if the keys are on the same finger of the same hand.
+ */
+bool achordion_same_finger(const keyrecord_t* tap_hold_record,
+                           const keyrecord_t* other_record);
+
+/**
+ * Returns true if the keys are pressed with neighboring fingers of one hand,
+ * thumbs excluded.
+ *
+ * @param tap_hold_record keyrecord_t from the tap-hold key's event.
+ * @param other_record keyrecord_t from the other key's event.
+ * @return True if the keys are on adjacent fingers of the same hand.
+ */
+bool achordion_adjacent_fingers(const keyrecord_t* tap_hold_record,
+                                const keyrecord_t* other_record);
+
+/**
+ * Several tap-hold keys may be tracked at once, each with its own timeout. A
+ * tap-hold key pressed while another is unsettled settles it as held, then is
+ * settled on its own while the earlier one stays held. Up to
+ * ACHORDION_POOL_SIZE keys are tracked, further ones are left to QMK's default
+ * handling. Adjust the size with:
+ *
+ *    #define ACHORDION_POOL_SIZE 4  // Default of 4 keys.
+ */
+
 /**
  * Suppress tap-hold mods within a *typing streak* by defining
  * ACHORDION_STREAK. This can help preventing accidental mod
@@ -177,17 +299,91 @@ bool achordion_opposite_hands(const keyrecord_t* tap_hold_record,
  *        uint16_t tap_hold_keycode, uint16_t next_keycode) {
  *      return 200;  // Default of 200 ms.
  *    }
+ *
+ * Or give pairs their own timeouts in a table, by defining
+ * ACHORDION_STREAK_TIMEOUTS and the table in your keymap.c:
+ *
+ *    const achordion_streak_timeout_t PROGMEM achordion_streak_timeouts[] = {
+ *        ACHORDION_STREAK_TIMEOUT_ENTRY(KC_A, KC_T, 120)  // a then t: 120 ms.
+ *    };
+ *    const uint8_t achordion_streak_timeouts_size =
+ *        ARRAY_SIZE(achordion_streak_timeouts);
+ *
+ * Pairs are given by the keycodes their keys tap, sorted by tap-hold keycode
+ * then next keycode, and looked up by binary search. Timeouts are stored in
+ * units of 4 ms up to 1020 ms. Pairs left out fall back to
+ * `achordion_streak_timeout()`.
  */
 #ifdef ACHORDION_STREAK
 uint16_t achordion_streak_chord_timeout(uint16_t tap_hold_keycode,
                                         uint16_t next_keycode);
 
+#ifdef ACHORDION_STREAK_TIMEOUTS
+typedef struct {
+  // Basic keycodes tapped by the tap-hold key and the next key.
+  uint8_t tap_hold_keycode;
+  uint8_t next_keycode;
+  // Streak timeout in units of 4 ms.
+  uint8_t timeout;
+} achordion_streak_timeout_t;
+
+#define ACHORDION_STREAK_TIMEOUT_ENTRY(tap_hold_keycode, next_keycode, ms) \
+  {(tap_hold_keycode), (next_keycode), ((ms) + 3) / 4},
+
+extern const achordion_streak_timeout_t achordion_streak_timeouts[];
+extern const uint8_t achordion_streak_timeouts_size;
+#endif
+
 bool achordion_streak_continue(uint16_t keycode);
 
 /** @deprecated Use `achordion_streak_chord_timeout()` instead. */
 uint16_t achordion_streak_timeout(uint16_t tap_hold_keycode);
 #endif
 
+/**
+ * Decision stats, compiled in by defining ACHORDION_STATS in config.h.
+ *
+ * Counts how often each tap-hold keycode is settled as tapped or held, by the
+ * path that settled it, and keeps log2 histograms of how long after the press
+ * each decision came, per path and outcome. Holds settled by a release alone
+ * are mostly taps longer than the tapping term, and chords that settle as taps
+ * are mostly rolls, which helps tuning `TAPPING_TERM`, `achordion_timeout()`
+ * and the streak timeouts.
+ *
+ * The first ACHORDION_STATS_KEYS (default 16) keycodes seen are counted, and
+ * histograms have ACHORDION_STATS_BUCKETS (default 12) buckets: bucket 0
+ * counts 0 ms, bucket n counts 2^(n-1) ms up to 2^n - 1 ms, and the last one
+ * everything above.
+ */
+#ifdef ACHORDION_STATS
+typedef enum {
+  // The timeout expired.
+  ACHORDION_PATH_TIMEOUT,
+  // Another key was pressed, per `achordion_chord()`.
+  ACHORDION_PATH_CHORD,
+  // Another key was pressed during a typing streak.
+  ACHORDION_PATH_STREAK,
+  // The key was released before any other key press.
+  ACHORDION_PATH_RELEASE,
+  ACHORDION_PATH_COUNT,
+} achordion_path_t;
+
+/** Prints the counters and histograms, CONSOLE_ENABLE is needed as well. */
+void achordion_stats_dump(void);
+
+/** Clears the counters and histograms. */
+void achordion_stats_reset(void);
+
+/**
+ * Gets a counter, e.g. to send the stats over raw HID.
+ *
+ * @return Times `keycode` was settled through `path` as held if `held`, else
+ * as tapped, or 0 if the keycode isn't counted.
+ */
+uint16_t achordion_stats_count(uint16_t keycode, achordion_path_t path,
+                               bool held);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
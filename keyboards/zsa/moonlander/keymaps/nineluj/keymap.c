@@ -6,7 +6,9 @@
 
 enum custom_keycodes {
   RGB_SLD = SAFE_RANGE,
-  HYPER
+  HYPER,
+  // prints the achordion decision stats to the console, see ACHORDION_STATS
+  ACH_STAT
 };
 
 enum layers {
@@ -162,7 +164,7 @@ const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS] = {
   ),
   [_LAYER_FN] = LAYOUT(
   // |-------+-------+-------+-------+-------+-------+-------|               |-------+-------+-------+-------+-------+-------+-------|
-      QK_BOOT,KC_NO,  KC_NO,  KC_NO,  KC_NO,  KC_NO,  KC_NO,                  KC_NO,  KC_NO,  KC_NO,  KC_NO,  KC_NO,  KC_NO,  KC_NO,
+      QK_BOOT,ACH_STAT,KC_NO, KC_NO,  KC_NO,  KC_NO,  KC_NO,                  KC_NO,  KC_NO,  KC_NO,  KC_NO,  KC_NO,  KC_NO,  KC_NO,
   // |-------+-------+-------+-------+-------+-------+-------|               |-------+-------+-------+-------+-------+-------+-------|
        KC_NO, KC_F12, KC_F7,  KC_F8,  KC_F9, KC_PSCR, KC_NO,                  KC_NO,  KC_NO,  KC_NO,  KC_NO,  KC_NO,  KC_NO,  KC_NO,
   // |-------+-------+-------+-------+-------+-------+-------|               |-------+-------+-------+-------+-------+-------+-------|
@@ -226,31 +228,67 @@ bool caps_word_press_user(uint16_t keycode) {
     }
 }
 
+// Hand, finger and row of every key, for the achordion chord rules, laid out like the keymaps
+#define _PL(finger, row) ACHORDION_POSITION(ACHORDION_LEFT, ACHORDION_##finger, row)
+#define _PR(finger, row) ACHORDION_POSITION(ACHORDION_RIGHT, ACHORDION_##finger, row)
+// the five outer columns of a hand, in layout order
+#define _L5(row) _PL(PINKY, row), _PL(PINKY, row), _PL(RING, row), _PL(MIDDLE, row), _PL(INDEX, row)
+#define _R5(row) _PR(INDEX, row), _PR(MIDDLE, row), _PR(RING, row), _PR(PINKY, row), _PR(PINKY, row)
+// expands the column macros before LAYOUT counts its arguments
+#define _LAYOUT_wrapper(...) LAYOUT(__VA_ARGS__)
+const uint8_t PROGMEM achordion_positions[MATRIX_ROWS][MATRIX_COLS] = _LAYOUT_wrapper(
+  // |-------+-------+-------+-------+-------+-------+-------|               |-------+-------+-------+-------+-------+-------+-------|
+       _L5(0),                           _PL(INDEX, 0), _PL(INDEX, 0),        _PR(INDEX, 0), _PR(INDEX, 0),                           _R5(0),
+  // |-------+-------+-------+-------+-------+-------+-------|               |-------+-------+-------+-------+-------+-------+-------|
+       _L5(1),                           _PL(INDEX, 1), _PL(INDEX, 1),        _PR(INDEX, 1), _PR(INDEX, 1),                           _R5(1),
+  // |-------+-------+-------+-------+-------+-------+-------|               |-------+-------+-------+-------+-------+-------+-------|
+       _L5(2),                           _PL(INDEX, 2), _PL(INDEX, 2),        _PR(INDEX, 2), _PR(INDEX, 2),                           _R5(2),
+  // |-------+-------+-------+-------+-------+-------+-------+               |-------+-------+-------+-------+-------+-------+-------+
+       _L5(3),                           _PL(INDEX, 3),                                      _PR(INDEX, 3),                           _R5(3),
+  // |-------+-------+-------+-------+-------+-------/                               \-------+-------+-------+-------+-------+-------|
+       _L5(4),                           _PL(THUMB, 4),                                      _PR(THUMB, 4),                           _R5(4),
+  // |-------+-------+-------+-------+-------+-------/                               \-------+-------+-------+-------+-------+-------|
+  //
+  //                                 |-------+-------+-------|               |-------+-------+-------|
+                     _PL(THUMB, 5), _PL(THUMB, 5), _PL(THUMB, 5),           _PR(THUMB, 5), _PR(THUMB, 5), _PR(THUMB, 5)
+  //                                 |-------+-------+-------|               |-------+-------+-------|
+);
+#undef _LAYOUT_wrapper
+#undef _L5
+#undef _R5
+#undef _PL
+#undef _PR
+
+#if defined(ACHORDION_STREAK) && defined(ACHORDION_STREAK_TIMEOUTS)
+// Streak timeouts of the pairs typed faster or slower than the default, generate the header from
+// typing logs with achordion_streak_timeouts.py before defining ACHORDION_STREAK_TIMEOUTS
+#include "achordion_streak_timeouts.h"
+const achordion_streak_timeout_t PROGMEM achordion_streak_timeouts[] = {ACHORDION_STREAK_TIMEOUT_PAIRS(ACHORDION_STREAK_TIMEOUT_ENTRY)};
+const uint8_t achordion_streak_timeouts_size = ARRAY_SIZE(achordion_streak_timeouts);
+#endif
+
 bool achordion_chord(uint16_t tap_hold_keycode, keyrecord_t* tap_hold_record,
                      uint16_t other_keycode, keyrecord_t* other_record) {
     // Exceptionally consider the following chords as holds,
     // even though they are on the same hand.
-    switch (tap_hold_keycode) {
-        case _BL_MT2: // left handed HRM control + space for alfred
-            if (other_keycode == _BL_T1) {
-              return true;
-            }
-            break;
-
-        // allow chording with thumb layer switch keys
-        case _BL_T0:
-        case _BL_T1:
-        case _BL_T2:
-        case _BR_T0:
-        case _BR_T1:
-        case _BR_T2:
-            return true;
+    if (tap_hold_keycode == _BL_MT2 && other_keycode == _BL_T1) {
+        // left handed HRM control + space for alfred
+        return true;
+    }
+
+    // allow chording with thumb layer switch keys
+    if (achordion_on_thumb(tap_hold_record)) {
+        return true;
     }
 
     // Otherwise, follow the opposite hands rule.
     return achordion_opposite_hands(tap_hold_record, other_record);
 }
 
+bool achordion_eager_layer(uint8_t layer) {
+    // Arrows and numbers are on thumb layers, turn them on before the chord settles
+    return layer == _LAYER_NAV || layer == _LAYER_NUM;
+}
 
 void matrix_scan_user(void) {
   achordion_task();
@@ -258,6 +296,16 @@ void matrix_scan_user(void) {
 
 bool process_record_user(uint16_t keycode, keyrecord_t *record) {
   if (!process_achordion(keycode, record)) { return false; }
+
+  switch (keycode) {
+    case ACH_STAT:
+#ifdef ACHORDION_STATS
+      if (record->event.pressed) {
+        achordion_stats_dump();
+      }
+#endif
+      return false;
+  }
   return true;
 }
 
@@ -0,0 +1,411 @@
+/* Copyright 2024 nineluj <code@nineluj.com> (@nineluj)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Minimal host-side stand-in for the parts of QMK that keymap.c and
+ * features/achordion.c touch. Only the behavior the simulator needs is
+ * modelled: a virtual clock, the keyboard report, mods, layers, the tap-hold
+ * keycodes and their actions, plus whatever the keymap's layers, combos and
+ * LED map need to compile. Everything lives in this header, shared by sim.c
+ * and achordion.c, which is built as its own translation unit so that the
+ * keymap's callbacks override its weak defaults as they do on the board.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* ************************************* *
+ *            PLATFORM SHIMS             *
+ * ************************************* */
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define MATRIX_ROWS 12
+#define MATRIX_COLS 7
+#define RGB_MATRIX_LED_COUNT 72
+
+#define dprintf(...)
+#define dprintln(s)
+
+/* ************************************* *
+ *                TIMER                  *
+ * ************************************* */
+
+extern uint32_t sim_now;
+
+static inline uint16_t timer_read(void) {
+    return (uint16_t)sim_now;
+}
+#define timer_expired(current, future) ((uint16_t)((current) - (future)) < UINT16_C(0x8000))
+
+void wait_ms(uint32_t ms);
+
+/* ************************************* *
+ *              KEYCODES                 *
+ * ************************************* */
+
+enum sim_keycodes {
+    KC_NO = 0x00,
+    KC_TRANSPARENT,
+    KC_A = 0x04,
+    KC_B,
+    KC_C,
+    KC_D,
+    KC_E,
+    KC_F,
+    KC_G,
+    KC_H,
+    KC_I,
+    KC_J,
+    KC_K,
+    KC_L,
+    KC_M,
+    KC_N,
+    KC_O,
+    KC_P,
+    KC_Q,
+    KC_R,
+    KC_S,
+    KC_T,
+    KC_U,
+    KC_V,
+    KC_W,
+    KC_X,
+    KC_Y,
+    KC_Z,
+    KC_1,
+    KC_2,
+    KC_3,
+    KC_4,
+    KC_5,
+    KC_6,
+    KC_7,
+    KC_8,
+    KC_9,
+    KC_0,
+    KC_ENTER,
+    KC_ESCAPE,
+    KC_BACKSPACE,
+    KC_TAB,
+    KC_SPACE,
+    KC_MINUS,
+    KC_EQUAL,
+    KC_LEFT_BRACKET,
+    KC_RIGHT_BRACKET,
+    KC_BACKSLASH,
+    KC_NONUS_HASH,
+    KC_SEMICOLON,
+    KC_QUOTE,
+    KC_GRAVE,
+    KC_COMMA,
+    KC_DOT,
+    KC_SLASH,
+    KC_CAPS_LOCK,
+    KC_F1,
+    KC_F2,
+    KC_F3,
+    KC_F4,
+    KC_F5,
+    KC_F6,
+    KC_F7,
+    KC_F8,
+    KC_F9,
+    KC_F10,
+    KC_F11,
+    KC_F12,
+    KC_PRINT_SCREEN,
+    KC_SCROLL_LOCK,
+    KC_PAUSE,
+    KC_INSERT,
+    KC_HOME,
+    KC_PAGE_UP,
+    KC_DELETE,
+    KC_END,
+    KC_PAGE_DOWN,
+    KC_RIGHT,
+    KC_LEFT,
+    KC_DOWN,
+    KC_UP,
+    KC_AUDIO_MUTE = 0xA8,
+    KC_AUDIO_VOL_UP,
+    KC_AUDIO_VOL_DOWN,
+    KC_MEDIA_NEXT_TRACK,
+    KC_MEDIA_PREV_TRACK,
+    KC_MEDIA_STOP,
+    KC_MEDIA_PLAY_PAUSE,
+    KC_MS_UP = 0xCD,
+    KC_MS_DOWN,
+    KC_MS_LEFT,
+    KC_MS_RIGHT,
+    KC_MS_BTN1,
+    KC_MS_BTN2,
+    KC_MS_BTN3,
+    KC_LEFT_CTRL = 0xE0,
+    KC_LEFT_SHIFT,
+    KC_LEFT_ALT,
+    KC_LEFT_GUI,
+    KC_RIGHT_CTRL,
+    KC_RIGHT_SHIFT,
+    KC_RIGHT_ALT,
+    KC_RIGHT_GUI,
+};
+
+#define KC_TRNS KC_TRANSPARENT
+#define KC_ESC KC_ESCAPE
+#define KC_BSPC KC_BACKSPACE
+#define KC_SPC KC_SPACE
+#define KC_MINS KC_MINUS
+#define KC_EQL KC_EQUAL
+#define KC_LBRC KC_LEFT_BRACKET
+#define KC_RBRC KC_RIGHT_BRACKET
+#define KC_BSLS KC_BACKSLASH
+#define KC_SCLN KC_SEMICOLON
+#define KC_GRV KC_GRAVE
+#define KC_COMM KC_COMMA
+#define KC_SLSH KC_SLASH
+#define KC_PSCR KC_PRINT_SCREEN
+#define KC_SCRL KC_SCROLL_LOCK
+#define KC_PAUS KC_PAUSE
+#define KC_PGUP KC_PAGE_UP
+#define KC_DEL KC_DELETE
+#define KC_PGDN KC_PAGE_DOWN
+#define KC_RGHT KC_RIGHT
+#define KC_MUTE KC_AUDIO_MUTE
+#define KC_VOLU KC_AUDIO_VOL_UP
+#define KC_VOLD KC_AUDIO_VOL_DOWN
+#define KC_MNXT KC_MEDIA_NEXT_TRACK
+#define KC_MPRV KC_MEDIA_PREV_TRACK
+#define KC_MPLY KC_MEDIA_PLAY_PAUSE
+#define KC_LCTL KC_LEFT_CTRL
+#define KC_LSFT KC_LEFT_SHIFT
+#define KC_LALT KC_LEFT_ALT
+#define KC_LGUI KC_LEFT_GUI
+#define MS_UP KC_MS_UP
+#define MS_DOWN KC_MS_DOWN
+#define MS_LEFT KC_MS_LEFT
+#define MS_RGHT KC_MS_RIGHT
+#define MS_BTN1 KC_MS_BTN1
+#define MS_BTN2 KC_MS_BTN2
+#define MS_BTN3 KC_MS_BTN3
+
+#define QK_MODS 0x0100
+#define QK_MODS_MAX 0x1FFF
+#define QK_MOD_TAP 0x2000
+#define QK_MOD_TAP_MAX 0x3FFF
+#define QK_LAYER_TAP 0x4000
+#define QK_LAYER_TAP_MAX 0x4FFF
+#define QK_TO 0x5200
+#define QK_BOOTLOADER 0x7C00
+#define QK_CAPS_WORD_TOGGLE 0x7C73
+#define RGB_TOG 0x7820
+#define RGB_MOD 0x7821
+#define RGB_HUI 0x7823
+#define RGB_SAI 0x7825
+#define RGB_VAI 0x7827
+#define SAFE_RANGE 0x7E40
+
+#define QK_BOOT QK_BOOTLOADER
+#define CW_TOGG QK_CAPS_WORD_TOGGLE
+
+#define MOD_LCTL 0x01
+#define MOD_LSFT 0x02
+#define MOD_LALT 0x04
+#define MOD_LGUI 0x08
+#define MOD_HYPR (MOD_LCTL | MOD_LSFT | MOD_LALT | MOD_LGUI)
+#define mod_config(mod) (mod)
+
+#define LSFT(kc) (QK_MODS | MOD_LSFT << 8 | (kc))
+#define LGUI(kc) (QK_MODS | MOD_LGUI << 8 | (kc))
+#define S(kc) LSFT(kc)
+#define TO(layer) (QK_TO | ((layer)&0x1F))
+#define MT(mod, kc) (QK_MOD_TAP | ((mod)&0x1F) << 8 | ((kc)&0xFF))
+#define LT(layer, kc) (QK_LAYER_TAP | ((layer)&0x0F) << 8 | ((kc)&0xFF))
+
+#define IS_QK_MOD_TAP(code) ((code) >= QK_MOD_TAP && (code) <= QK_MOD_TAP_MAX)
+#define IS_QK_LAYER_TAP(code) ((code) >= QK_LAYER_TAP && (code) <= QK_LAYER_TAP_MAX)
+#define QK_MOD_TAP_GET_MODS(kc) (((kc) >> 8) & 0x1F)
+#define QK_MOD_TAP_GET_TAP_KEYCODE(kc) ((kc)&0xFF)
+#define QK_LAYER_TAP_GET_LAYER(kc) (((kc) >> 8) & 0x0F)
+#define QK_LAYER_TAP_GET_TAP_KEYCODE(kc) ((kc)&0xFF)
+
+#define KC_TILD LSFT(KC_GRAVE)
+#define KC_EXLM LSFT(KC_1)
+#define KC_AT LSFT(KC_2)
+#define KC_HASH LSFT(KC_3)
+#define KC_DLR LSFT(KC_4)
+#define KC_PERC LSFT(KC_5)
+#define KC_CIRC LSFT(KC_6)
+#define KC_AMPR LSFT(KC_7)
+#define KC_ASTR LSFT(KC_8)
+#define KC_LPRN LSFT(KC_9)
+#define KC_RPRN LSFT(KC_0)
+#define KC_UNDS LSFT(KC_MINUS)
+#define KC_PLUS LSFT(KC_EQUAL)
+#define KC_LCBR LSFT(KC_LEFT_BRACKET)
+#define KC_RCBR LSFT(KC_RIGHT_BRACKET)
+#define KC_PIPE LSFT(KC_BACKSLASH)
+#define KC_COLN LSFT(KC_SEMICOLON)
+
+#define IS_MODIFIER_KEYCODE(code) ((code) >= KC_LEFT_CTRL && (code) <= KC_RIGHT_GUI)
+#define MOD_BIT(code) (1 << ((code)&0x07))
+#define MOD_BIT_LALT MOD_BIT(KC_LEFT_ALT)
+#define MOD_MASK_CG (MOD_BIT(KC_LEFT_CTRL) | MOD_BIT(KC_RIGHT_CTRL) | MOD_BIT(KC_LEFT_GUI) | MOD_BIT(KC_RIGHT_GUI))
+
+/* ************************************* *
+ *            KEY EVENTS                 *
+ * ************************************* */
+
+typedef struct {
+    uint8_t col;
+    uint8_t row;
+} keypos_t;
+
+typedef enum { TICK_EVENT = 0, KEY_EVENT = 1 } keyevent_type_t;
+
+typedef struct {
+    keypos_t        key;
+    uint16_t        time;
+    keyevent_type_t type;
+    bool            pressed;
+} keyevent_t;
+
+typedef struct {
+    bool    interrupted : 1;
+    bool    reserved2 : 1;
+    bool    reserved1 : 1;
+    bool    reserved0 : 1;
+    uint8_t count : 4;
+} tap_t;
+
+typedef struct {
+    keyevent_t event;
+    tap_t      tap;
+    uint16_t   keycode;
+} keyrecord_t;
+
+#define MAKE_KEYPOS(row_num, col_num) ((keypos_t){.row = (row_num), .col = (col_num)})
+#define MAKE_KEYEVENT(row_num, col_num, press) ((keyevent_t){.key = MAKE_KEYPOS((row_num), (col_num)), .pressed = (press), .time = timer_read(), .type = KEY_EVENT})
+#define KEYEQ(keya, keyb) ((keya).row == (keyb).row && (keya).col == (keyb).col)
+#define IS_KEYEVENT(event) ((event).type == KEY_EVENT)
+
+void     process_record(keyrecord_t *record);
+bool     process_record_user(uint16_t keycode, keyrecord_t *record);
+uint16_t get_event_keycode(keyevent_t event, bool update_layer_cache);
+
+/* ************************************* *
+ *              ACTIONS                  *
+ * ************************************* */
+
+typedef union {
+    uint16_t code;
+} action_t;
+
+enum sim_action_kinds {
+    ACT_LMODS     = 0x0,
+    ACT_LMODS_TAP = 0x2,
+    ACT_LAYER_TAP = 0xA,
+};
+
+#define ACTION(kind, param) ((kind) << 12 | (param))
+#define ACTION_MODS(mods) ACTION(ACT_LMODS, ((mods)&0xF) << 8)
+#define ACTION_MODS_TAP_KEY(mods, key) ACTION(ACT_LMODS_TAP, ((mods)&0xF) << 8 | (key))
+#define ACTION_LAYER_TAP_KEY(layer, key) ACTION(ACT_LAYER_TAP, (layer) << 8 | (key))
+
+void process_action(keyrecord_t *record, action_t action);
+
+/* ************************************* *
+ *          REPORT AND MODS              *
+ * ************************************* */
+
+#define KEYBOARD_REPORT_KEYS 6
+
+typedef struct {
+    uint8_t mods;
+    uint8_t reserved;
+    uint8_t keys[KEYBOARD_REPORT_KEYS];
+} report_keyboard_t;
+
+uint8_t get_mods(void);
+void    add_weak_mods(uint8_t mods);
+void    clear_weak_mods(void);
+void    register_mods(uint8_t mods);
+void    unregister_mods(uint8_t mods);
+void    send_keyboard_report(void);
+
+void register_code(uint8_t code);
+void unregister_code(uint8_t code);
+void register_code16(uint16_t code);
+void unregister_code16(uint16_t code);
+
+bool is_caps_word_on(void);
+
+/* ************************************* *
+ *               LAYERS                  *
+ * ************************************* */
+
+typedef uint32_t layer_state_t;
+
+extern layer_state_t layer_state;
+extern layer_state_t default_layer_state;
+
+void    layer_state_set(layer_state_t state);
+void    layer_move(uint8_t layer);
+void    layer_on(uint8_t layer);
+void    layer_off(uint8_t layer);
+uint8_t layer_switch_get_layer(keypos_t key);
+
+extern const uint16_t keymaps[][MATRIX_ROWS][MATRIX_COLS];
+uint16_t              keymap_key_to_keycode(uint8_t layer, keypos_t key);
+
+/* ************************************* *
+ *        FEATURE STAND-INS              *
+ * ************************************* */
+
+// clang-format off
+#define LAYOUT(                                                       \
+    k00, k01, k02, k03, k04, k05, k06,   k60, k61, k62, k63, k64, k65, k66, \
+    k10, k11, k12, k13, k14, k15, k16,   k70, k71, k72, k73, k74, k75, k76, \
+    k20, k21, k22, k23, k24, k25, k26,   k80, k81, k82, k83, k84, k85, k86, \
+    k30, k31, k32, k33, k34, k35,             k91, k92, k93, k94, k95, k96, \
+    k40, k41, k42, k43, k44,      k53,   kb3,      ka2, ka3, ka4, ka5, ka6, \
+                        k50, k51, k52,   kb4, kb5, kb6)                       \
+    {                                                                     \
+        {k00, k01, k02, k03, k04, k05, k06},                              \
+        {k10, k11, k12, k13, k14, k15, k16},                              \
+        {k20, k21, k22, k23, k24, k25, k26},                              \
+        {k30, k31, k32, k33, k34, k35, KC_NO},                            \
+        {k40, k41, k42, k43, k44, KC_NO, KC_NO},                          \
+        {k50, k51, k52, k53, KC_NO, KC_NO, KC_NO},                        \
+        {k60, k61, k62, k63, k64, k65, k66},                              \
+        {k70, k71, k72, k73, k74, k75, k76},                              \
+        {k80, k81, k82, k83, k84, k85, k86},                              \
+        {KC_NO, k91, k92, k93, k94, k95, k96},                            \
+        {KC_NO, KC_NO, ka2, ka3, ka4, ka5, ka6},                          \
+        {KC_NO, KC_NO, KC_NO, kb3, kb4, kb5, kb6},                        \
+    }
+// clang-format on
+
+typedef struct {
+    const uint16_t *keys;
+    uint16_t        keycode;
+} combo_t;
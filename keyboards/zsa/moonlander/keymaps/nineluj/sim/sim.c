@@ -0,0 +1,570 @@
+/* Copyright 2024 nineluj <code@nineluj.com> (@nineluj)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Deterministic host simulator for the Moonlander keymap and achordion.
+ *
+ * A scenario is a line of space separated steps: "t+" presses the key
+ * labelled t on the base layer, "t-" releases it and a number advances the
+ * virtual clock by that many milliseconds, scanning once per millisecond.
+ * The thumb keys are LT0 to LT2 and RT0 to RT2, as _BL_T0 to _BR_T2 in
+ * keymap.c. Every scenario ends with two idle seconds and prints the HID
+ * reports and layer changes it produced:
+ *
+ *   t+ 200 h+ 20 h- 20 t- => [02][02 0b][02][00] | mods=00 layer=0
+ *
+ * "[mods keys...]" is a keyboard report and "{Lstate}" a layer change, the
+ * tail is the state left behind. Every scenario runs in a forked copy of a
+ * fresh process, so the static state of achordion never leaks between them.
+ *
+ * Achordion sits behind QMK's tap-hold handling, so events go through a
+ * stand-in for action_tapping.c with its default options first: a tap-hold
+ * key pressed alone is a tap if released within TAPPING_TERM, a hold past it,
+ * and the events that come meanwhile wait until it is decided.
+ *
+ *   achordion_sim < scripts        prints the result of every script
+ *   achordion_sim FILE...          checks "script => expected" lines
+ */
+
+#include "qmk_stub.h"
+
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+uint32_t sim_now = 1000;
+
+/* ************************************* *
+ *                 LOG                   *
+ * ************************************* */
+
+static char   sim_log[16 * 1024];
+static size_t sim_log_len = 0;
+
+static void sim_log_str(const char *str) {
+    size_t len = strlen(str);
+    if (sim_log_len + len + 1 < sizeof(sim_log)) {
+        memcpy(sim_log + sim_log_len, str, len + 1);
+        sim_log_len += len;
+    }
+}
+
+/* ************************************* *
+ *           REPORT AND MODS             *
+ * ************************************* */
+
+static report_keyboard_t keyboard_report;
+static report_keyboard_t last_report;
+static uint8_t           real_mods, weak_mods;
+
+void send_keyboard_report(void) {
+    keyboard_report.mods = real_mods | weak_mods;
+    if (memcmp(&keyboard_report, &last_report, sizeof(keyboard_report)) == 0) {
+        return;
+    }
+    last_report = keyboard_report;
+
+    char buffer[64];
+    int  len = snprintf(buffer, sizeof(buffer), "[%02x", keyboard_report.mods);
+    for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+        if (keyboard_report.keys[i]) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, " %02x", keyboard_report.keys[i]);
+        }
+    }
+    snprintf(buffer + len, sizeof(buffer) - len, "]");
+    sim_log_str(buffer);
+}
+
+uint8_t get_mods(void) {
+    return real_mods;
+}
+void add_weak_mods(uint8_t mods) {
+    weak_mods |= mods;
+}
+void clear_weak_mods(void) {
+    weak_mods = 0;
+}
+
+void register_mods(uint8_t mods) {
+    if (mods) {
+        real_mods |= mods;
+        send_keyboard_report();
+    }
+}
+
+void unregister_mods(uint8_t mods) {
+    if (mods) {
+        real_mods &= ~mods;
+        send_keyboard_report();
+    }
+}
+
+static void sim_add_key(uint8_t code) {
+    for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+        if (keyboard_report.keys[i] == code) {
+            return;
+        }
+    }
+    for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+        if (!keyboard_report.keys[i]) {
+            keyboard_report.keys[i] = code;
+            return;
+        }
+    }
+}
+
+static void sim_del_key(uint8_t code) {
+    for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+        if (keyboard_report.keys[i] == code) {
+            keyboard_report.keys[i] = 0;
+        }
+    }
+}
+
+void register_code(uint8_t code) {
+    if (code == KC_NO) {
+        return;
+    }
+    if (IS_MODIFIER_KEYCODE(code)) {
+        real_mods |= MOD_BIT(code);
+    } else {
+        sim_add_key(code);
+    }
+    send_keyboard_report();
+}
+
+void unregister_code(uint8_t code) {
+    if (code == KC_NO) {
+        return;
+    }
+    if (IS_MODIFIER_KEYCODE(code)) {
+        real_mods &= ~MOD_BIT(code);
+    } else {
+        sim_del_key(code);
+    }
+    send_keyboard_report();
+}
+
+/** The left hand mods of a 16 bit keycode, the keymap never uses the right hand ones */
+static uint8_t sim_mods_of(uint16_t code) {
+    return (code >> 8) & 0x0F;
+}
+
+void register_code16(uint16_t code) {
+    add_weak_mods(sim_mods_of(code));
+    register_code(code & 0xFF);
+}
+
+void unregister_code16(uint16_t code) {
+    unregister_code(code & 0xFF);
+    weak_mods &= ~sim_mods_of(code);
+    send_keyboard_report();
+}
+
+bool is_caps_word_on(void) {
+    return false;
+}
+
+/* ************************************* *
+ *               LAYERS                  *
+ * ************************************* */
+
+layer_state_t layer_state         = 0;
+layer_state_t default_layer_state = 1;
+
+void layer_state_set(layer_state_t state) {
+    if (state == layer_state) {
+        return;
+    }
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "{L%x}", (unsigned)state);
+    sim_log_str(buffer);
+    layer_state = state;
+}
+
+void layer_move(uint8_t layer) {
+    layer_state_set((layer_state_t)1 << layer);
+}
+void layer_on(uint8_t layer) {
+    layer_state_set(layer_state | ((layer_state_t)1 << layer));
+}
+void layer_off(uint8_t layer) {
+    layer_state_set(layer_state & ~((layer_state_t)1 << layer));
+}
+
+static uint8_t source_layers[MATRIX_ROWS][MATRIX_COLS];
+
+/** The highest active layer where the key is not transparent */
+uint8_t layer_switch_get_layer(keypos_t key) {
+    layer_state_t state = layer_state | default_layer_state;
+    for (int layer = 31; layer >= 0; layer--) {
+        if ((state & ((layer_state_t)1 << layer)) && keymaps[layer][key.row][key.col] != KC_TRNS) {
+            return layer;
+        }
+    }
+    return 0;
+}
+
+uint16_t keymap_key_to_keycode(uint8_t layer, keypos_t key) {
+    return keymaps[layer][key.row][key.col];
+}
+
+/** Presses are looked up on the layers on now, releases on the layer of their press */
+uint16_t get_event_keycode(keyevent_t event, bool update_layer_cache) {
+    keypos_t key = event.key;
+    if (!event.pressed) {
+        return keymap_key_to_keycode(source_layers[key.row][key.col], key);
+    }
+    uint8_t layer = layer_switch_get_layer(key);
+    if (update_layer_cache) {
+        source_layers[key.row][key.col] = layer;
+    }
+    return keymap_key_to_keycode(layer, key);
+}
+
+/* ************************************* *
+ *          KEYMAP UNDER TEST            *
+ * ************************************* */
+
+#include "keymap.c"
+
+void wait_ms(uint32_t ms) {
+    sim_now += ms;
+}
+
+/* ************************************* *
+ *              ACTIONS                  *
+ * ************************************* */
+
+/** Runs a mod-tap or layer-tap action, a tap of its key when tap.count is set */
+static void sim_tap_hold_action(keyrecord_t *record, uint8_t tap_keycode, uint8_t mods, int8_t layer) {
+    bool pressed = record->event.pressed;
+    if (record->tap.count) {
+        if (pressed) {
+            register_code(tap_keycode);
+        } else {
+            unregister_code(tap_keycode);
+        }
+    } else if (layer >= 0) {
+        if (pressed) {
+            layer_on(layer);
+        } else {
+            layer_off(layer);
+        }
+    } else if (pressed) {
+        register_mods(mods);
+    } else {
+        unregister_mods(mods);
+    }
+}
+
+void process_action(keyrecord_t *record, action_t action) {
+    uint8_t param = (action.code >> 8) & 0x0F;
+    switch (action.code >> 12) {
+        case ACT_LMODS:
+            if (record->event.pressed) {
+                register_mods(param);
+            } else {
+                unregister_mods(param);
+            }
+            break;
+        case ACT_LMODS_TAP:
+            sim_tap_hold_action(record, action.code & 0xFF, param, -1);
+            break;
+        case ACT_LAYER_TAP:
+            sim_tap_hold_action(record, action.code & 0xFF, 0, param);
+            break;
+    }
+}
+
+/** Looks up the keycode like QMK's action layer, then runs what the keymap passes on */
+void process_record(keyrecord_t *record) {
+    uint16_t keycode = get_event_keycode(record->event, true);
+    if (!process_record_user(keycode, record)) {
+        return;
+    }
+
+    bool pressed = record->event.pressed;
+    if (keycode <= 0xFF) {
+        if (pressed) {
+            register_code(keycode);
+        } else {
+            unregister_code(keycode);
+        }
+    } else if (QK_MODS <= keycode && keycode <= QK_MODS_MAX) {
+        if (pressed) {
+            register_code16(keycode);
+        } else {
+            unregister_code16(keycode);
+        }
+    } else if (IS_QK_MOD_TAP(keycode)) {
+        sim_tap_hold_action(record, QK_MOD_TAP_GET_TAP_KEYCODE(keycode), QK_MOD_TAP_GET_MODS(keycode), -1);
+    } else if (IS_QK_LAYER_TAP(keycode)) {
+        sim_tap_hold_action(record, QK_LAYER_TAP_GET_TAP_KEYCODE(keycode), 0, QK_LAYER_TAP_GET_LAYER(keycode));
+    } else if ((keycode & 0xFFE0) == QK_TO && pressed) {
+        layer_move(keycode & 0x1F);
+    }
+}
+
+/* ************************************* *
+ *              TAPPING                  *
+ * ************************************* */
+
+#define SIM_WAITING_SIZE 16
+
+/** The tap-hold key waiting to be decided, valid while sim_tapping is set */
+static keyrecord_t sim_tapping_key;
+static bool        sim_tapping = false;
+
+/** The events that came while it waits, in order */
+static keyrecord_t sim_waiting[SIM_WAITING_SIZE];
+static uint8_t     sim_waiting_size = 0;
+
+/** The tap count of every pressed key, for its release */
+static uint8_t sim_tap_counts[MATRIX_ROWS][MATRIX_COLS];
+
+static bool sim_is_tap_hold(const keyrecord_t *record) {
+    keypos_t key     = record->event.key;
+    uint16_t keycode = keymap_key_to_keycode(layer_switch_get_layer(key), key);
+    return IS_QK_MOD_TAP(keycode) || IS_QK_LAYER_TAP(keycode);
+}
+
+/** Decides the waiting tap-hold key if it can be, then passes on the events that no longer wait */
+static void sim_tapping_run(void) {
+    for (;;) {
+        if (sim_tapping) {
+            bool decided = false, tapped = false;
+            for (uint8_t i = 0; i < sim_waiting_size && !decided; i++) {
+                keyevent_t *event = &sim_waiting[i].event;
+                if ((uint16_t)(event->time - sim_tapping_key.event.time) >= TAPPING_TERM) {
+                    decided = true;
+                } else if (!event->pressed && KEYEQ(event->key, sim_tapping_key.event.key)) {
+                    decided = tapped = true;
+                }
+            }
+            if (!decided && (uint16_t)(timer_read() - sim_tapping_key.event.time) < TAPPING_TERM) {
+                return;
+            }
+
+            keypos_t key                    = sim_tapping_key.event.key;
+            sim_tapping_key.tap.count       = tapped;
+            sim_tap_counts[key.row][key.col] = tapped;
+            sim_tapping                     = false;
+            process_record(&sim_tapping_key);
+            continue;
+        }
+
+        if (!sim_waiting_size) {
+            return;
+        }
+        keyrecord_t record = sim_waiting[0];
+        memmove(&sim_waiting[0], &sim_waiting[1], --sim_waiting_size * sizeof(keyrecord_t));
+        if (record.event.pressed && sim_is_tap_hold(&record)) {
+            sim_tapping_key = record;
+            sim_tapping     = true;
+            continue;
+        }
+        keypos_t key     = record.event.key;
+        record.tap.count = record.event.pressed ? 0 : sim_tap_counts[key.row][key.col];
+        process_record(&record);
+    }
+}
+
+/* ************************************* *
+ *              SCENARIOS                *
+ * ************************************* */
+
+/** The labels of the keys in the scripts, on the base layer */
+// clang-format off
+static const char *sim_key_names[MATRIX_ROWS][MATRIX_COLS] = LAYOUT(
+    "",  "",  "",  "",  "",  "",  "",      "",  "",  "",  "",  "",  "",  "",
+    "",  "q", "w", "f", "p", "b", "",      "",  "j", "l", "u", "y", "'", "",
+    "",  "a", "r", "s", "t", "g", "",      "",  "m", "n", "e", "i", "o", "",
+    "",  "z", "x", "c", "d", "v",               "k", "h", ",", ".", "/", "",
+    "",  "",  "",  "",  "",       "",      "",       "",  "",  "",  "",  "",
+                        "LT0", "LT1", "LT2",   "RT2", "RT1", "RT0"
+);
+// clang-format on
+
+static bool sim_find_key(const char *name, size_t len, keypos_t *key) {
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+        for (uint8_t col = 0; col < MATRIX_COLS; col++) {
+            const char *label = sim_key_names[row][col];
+            if (len && label && strlen(label) == len && strncmp(label, name, len) == 0) {
+                *key = MAKE_KEYPOS(row, col);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void sim_scan(void) {
+    sim_tapping_run();
+    matrix_scan_user();
+}
+
+static void sim_advance(uint32_t ms) {
+    for (uint32_t i = 0; i < ms; i++) {
+        sim_now++;
+        sim_scan();
+    }
+}
+
+static void sim_event(keypos_t key, bool pressed) {
+    if (sim_waiting_size == SIM_WAITING_SIZE) {
+        fprintf(stderr, "too many events waiting for a tap-hold key\n");
+        _exit(2);
+    }
+    sim_waiting[sim_waiting_size++] = (keyrecord_t){.event = MAKE_KEYEVENT(key.row, key.col, pressed)};
+    sim_scan();
+}
+
+static bool sim_run_script(const char *script) {
+    while (*script) {
+        while (*script == ' ') {
+            script++;
+        }
+        if (!*script) {
+            break;
+        }
+        if ('0' <= *script && *script <= '9') {
+            sim_advance(strtoul(script, (char **)&script, 10));
+            continue;
+        }
+
+        const char *name = script;
+        while (*script && *script != '+' && *script != '-' && *script != ' ') {
+            script++;
+        }
+        keypos_t key;
+        if ((*script != '+' && *script != '-') || !sim_find_key(name, script - name, &key)) {
+            fprintf(stderr, "bad step in script: %s\n", name);
+            return false;
+        }
+        sim_event(key, *script++ == '+');
+    }
+
+    sim_advance(2000);
+    return true;
+}
+
+/** Runs a script in a child process and writes its result, without a trailing newline, to result */
+static bool sim_run(const char *script, char *result, size_t size) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        if (!sim_run_script(script)) {
+            _exit(2);
+        }
+        char tail[64];
+        snprintf(tail, sizeof(tail), " | mods=%02x layer=%x", real_mods | weak_mods, (unsigned)layer_state);
+        sim_log_str(tail);
+        if (write(pipe_fds[1], sim_log, sim_log_len) != (ssize_t)sim_log_len) {
+            _exit(3);
+        }
+        _exit(0);
+    }
+
+    close(pipe_fds[1]);
+    size_t  len = 0;
+    ssize_t got;
+    while (len + 1 < size && (got = read(pipe_fds[0], result + len, size - len - 1)) > 0) {
+        len += got;
+    }
+    result[len] = 0;
+    close(pipe_fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static char *sim_trim(char *str) {
+    while (*str == ' ') {
+        str++;
+    }
+    size_t len = strlen(str);
+    while (len && (str[len - 1] == ' ' || str[len - 1] == '\n' || str[len - 1] == '\r')) {
+        str[--len] = 0;
+    }
+    return str;
+}
+
+/** Checks every "script => expected" line of a scenario file, returns the number of failures */
+static int sim_check_file(const char *path, int *count) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+
+    static char line[4096], result[sizeof(sim_log)];
+    int         failures = 0;
+    for (int number = 1; fgets(line, sizeof(line), file); number++) {
+        char *script = sim_trim(line);
+        if (!*script || *script == '#') {
+            continue;
+        }
+
+        char *expected = strstr(script, "=>");
+        if (!expected) {
+            fprintf(stderr, "%s:%d: missing =>\n", path, number);
+            failures++;
+            continue;
+        }
+        *expected = 0;
+        expected  = sim_trim(expected + 2);
+        script    = sim_trim(script);
+
+        (*count)++;
+        if (!sim_run(script, result, sizeof(result)) || strcmp(result, expected) != 0) {
+            printf("%s:%d: FAIL %s\n  expected %s\n  got      %s\n", path, number, script, expected, result);
+            failures++;
+        }
+    }
+
+    fclose(file);
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        int count = 0, failures = 0;
+        for (int i = 1; i < argc; i++) {
+            failures += sim_check_file(argv[i], &count);
+        }
+        printf("%d scenarios, %d failed\n", count, failures);
+        return failures ? 1 : 0;
+    }
+
+    static char line[4096], result[sizeof(sim_log)];
+    while (fgets(line, sizeof(line), stdin)) {
+        char *script = sim_trim(line);
+        if (!*script || *script == '#') {
+            continue;
+        }
+        sim_run(script, result, sizeof(result));
+        printf("%s => %s\n", script, result);
+        fflush(stdout);
+    }
+    return 0;
+}